@@ -17,38 +17,311 @@
 //
 // Audio output. Supports PWM (through a PwmOutput object) and DAC (through a
 // Dac object, for example the one defined in mcp492x.h).
+//
+// MultiChannelAudioOutput stores frames of several channels in a single
+// buffer, and sends them to an output port writing a whole frame at once
+// (StereoPwmOutput, StereoDacOutput).
+//
+// AudioSampleClock drives an AudioOutput from a timer interrupt:
+//
+// typedef AudioOutput<PwmOutput<3>, 64, 16> Audio;
+// typedef AudioSampleClock<Audio, 1, 39062> SampleClock;
+// AUDIO_SAMPLE_CLOCK_ISR(1, SampleClock)
+//
+// SampleClock::Init() in the setup code, and in the main loop:
+//
+// if (SampleClock::block_needed()) {
+//   SampleClock::Fill<Renderer>();  // Calls Renderer::Render() for each block.
+// }
 
 #ifndef AVRLIB_AUDIO_OUTPUT_H_
 #define AVRLIB_AUDIO_OUTPUT_H_
 
+#include <string.h>
+
 #include "avrlib/base.h"
 #include "avrlib/avrlib.h"
+#include "avrlib/log2.h"
+#include "avrlib/op.h"
 #include "avrlib/ring_buffer.h"
+#include "avrlib/timer.h"
 
 namespace avrlib {
 
 enum UnderrunPolicy {
+  // Outputs 0. Underruns are easy to hear.
   EMIT_CLICK = 0,
-  HOLD_SAMPLE = 1
+  // Keeps outputting the last sample.
+  HOLD_SAMPLE = 1,
+  // Ramps linearly from the last sample to the DC midpoint.
+  FADE_TO_MIDPOINT = 2,
+  // Loops over the last block, crossfaded with the last sample to avoid a
+  // discontinuity.
+  REPEAT_LAST_BLOCK = 3,
+  // Same as HOLD_SAMPLE, and also keeps track of the lowest fill level of the
+  // buffer (PullLowWaterMark). Nothing is adapted by the output itself: it is
+  // up to the renderer to poll the low-water mark and switch to a cheaper
+  // rendering before an underrun happens.
+  ADAPTIVE = 4
+};
+
+// Bookkeeping shared by AudioOutput and MultiChannelAudioOutput: underrun
+// counter, lowest fill level of the buffer (ADAPTIVE policy) and histogram of
+// the fill level (when fill_histogram is set). Owner is the audio output class,
+// so that each output has its own counters.
+template<typename Owner,
+         uint8_t buffer_size,
+         UnderrunPolicy underrun_policy,
+         bool fill_histogram>
+class AudioBufferMonitor {
+ public:
+  AudioBufferMonitor() { }
+  enum {
+    num_histogram_bins = 8,
+    // Buffers of less than 8 samples only use the first buffer_size bins.
+    histogram_shift = Log2<buffer_size>::value > 3 ?
+        Log2<buffer_size>::value - 3 : 0
+  };
+
+  static inline void Init() {
+    low_water_mark_ = 0xff;
+  }
+
+  // Called from data emission interrupt, with the number of samples waiting
+  // in the buffer.
+  static inline void Update(uint8_t level) {
+    if (fill_histogram) {
+      uint8_t bin = level >> histogram_shift;
+      if (histogram_[bin] != 0xffff) {
+        ++histogram_[bin];
+      }
+    }
+    if (underrun_policy == ADAPTIVE && level < low_water_mark_) {
+      low_water_mark_ = level;
+    }
+    if (!level) {
+      ++num_glitches_;
+    }
+  }
+
+  static inline uint8_t num_glitches() { return num_glitches_; }
+  static inline void ResetGlitchCounter() { num_glitches_ = 0; }
+
+  // In ADAPTIVE mode, lowest number of samples which were waiting in the
+  // buffer since the last call. A value close to 0 means that the renderer
+  // should use a cheaper algorithm.
+  static inline uint8_t PullLowWaterMark() {
+    uint8_t value = low_water_mark_;
+    low_water_mark_ = 0xff;
+    return value;
+  }
+
+  // When fill_histogram is set, number of samples emitted while the fill
+  // level of the buffer was in the bin-th eighth of its size. Counters
+  // saturate at 65535.
+  static inline uint16_t histogram(uint8_t bin) {
+    uint8_t old_sreg = SREG;
+    cli();
+    uint16_t value = histogram_[bin];
+    SREG = old_sreg;
+    return value;
+  }
+  static inline void ResetHistogram() {
+    uint8_t old_sreg = SREG;
+    cli();
+    memset(histogram_, 0, sizeof(histogram_));
+    SREG = old_sreg;
+  }
+
+ private:
+  static uint8_t num_glitches_;
+  static volatile uint8_t low_water_mark_;
+  static uint16_t histogram_[num_histogram_bins];
+
+  DISALLOW_COPY_AND_ASSIGN(AudioBufferMonitor);
+};
+
+/* static */
+template<typename Owner, uint8_t buffer_size, UnderrunPolicy underrun_policy,
+         bool fill_histogram>
+uint8_t AudioBufferMonitor<Owner, buffer_size, underrun_policy,
+                           fill_histogram>::num_glitches_ = 0;
+
+/* static */
+template<typename Owner, uint8_t buffer_size, UnderrunPolicy underrun_policy,
+         bool fill_histogram>
+volatile uint8_t AudioBufferMonitor<Owner, buffer_size, underrun_policy,
+                                    fill_histogram>::low_water_mark_;
+
+/* static */
+template<typename Owner, uint8_t buffer_size, UnderrunPolicy underrun_policy,
+         bool fill_histogram>
+uint16_t AudioBufferMonitor<Owner, buffer_size, underrun_policy,
+                            fill_histogram>::histogram_[num_histogram_bins];
+
+// Generates the samples emitted during an underrun, for frames of num_channels
+// samples. AudioOutput uses it with num_channels = 1.
+template<typename Owner,
+         typename T,
+         uint8_t data_size,
+         uint8_t num_channels,
+         uint8_t block_size,
+         UnderrunPolicy underrun_policy>
+class UnderrunConcealer {
+ public:
+  UnderrunConcealer() { }
+
+  static inline void Init() {
+    for (uint8_t i = 0; i < num_channels; ++i) {
+      last_sample_[i] = T(1) << (data_size - 1);
+    }
+  }
+
+  // Called from data emission interrupt, after a frame from the buffer has
+  // been written to the output port.
+  static inline void Played(const T* frame) {
+    if (underrun_policy == FADE_TO_MIDPOINT ||
+        underrun_policy == REPEAT_LAST_BLOCK) {
+      for (uint8_t i = 0; i < num_channels; ++i) {
+        last_sample_[i] = frame[i];
+      }
+    }
+    if (underrun_policy == REPEAT_LAST_BLOCK) {
+      T* slot = &last_block_[last_block_ptr_ * num_channels];
+      for (uint8_t i = 0; i < num_channels; ++i) {
+        slot[i] = frame[i];
+      }
+      ++last_block_ptr_;
+      if (last_block_ptr_ == block_size) {
+        last_block_ptr_ = 0;
+      }
+      crossfade_ = 0;
+    }
+  }
+
+  // Called from data emission interrupt when the buffer is empty. Fills frame
+  // with the samples to emit, or returns 0 if the output port must be left
+  // untouched (HOLD_SAMPLE, ADAPTIVE).
+  static inline uint8_t Conceal(T* frame) {
+    if (underrun_policy == EMIT_CLICK) {
+      // Introduces clicks to allow underruns to be easily detected.
+      for (uint8_t i = 0; i < num_channels; ++i) {
+        frame[i] = 0;
+      }
+    } else if (underrun_policy == FADE_TO_MIDPOINT) {
+      for (uint8_t i = 0; i < num_channels; ++i) {
+        frame[i] = FadeToMidpoint(i);
+      }
+    } else if (underrun_policy == REPEAT_LAST_BLOCK) {
+      const T* repeated = &last_block_[last_block_ptr_ * num_channels];
+      ++last_block_ptr_;
+      if (last_block_ptr_ == block_size) {
+        last_block_ptr_ = 0;
+      }
+      if (crossfade_ != 255) {
+        crossfade_ += crossfade_step;
+      }
+      for (uint8_t i = 0; i < num_channels; ++i) {
+        frame[i] = Crossfade(last_sample_[i], repeated[i]);
+      }
+    } else {
+      return 0;
+    }
+    return 1;
+  }
+
+ private:
+  enum {
+    fade_step = data_size > 8 ? 256 : 1,
+    crossfade_step = 15,
+    // The last block is only stored for the policy which replays it.
+    last_block_size = underrun_policy == REPEAT_LAST_BLOCK ?
+        block_size * num_channels : 1
+  };
+
+  static inline T FadeToMidpoint(uint8_t channel) {
+    T midpoint = T(1) << (data_size - 1);
+    T sample = last_sample_[channel];
+    if (sample > midpoint + fade_step) {
+      sample -= fade_step;
+    } else if (sample < midpoint - fade_step) {
+      sample += fade_step;
+    } else {
+      sample = midpoint;
+    }
+    last_sample_[channel] = sample;
+    return sample;
+  }
+
+  static inline T Crossfade(T last, T repeated) {
+    if (data_size > 8) {
+      return U16U8MulShift8(last, 255 - crossfade_) +
+          U16U8MulShift8(repeated, crossfade_);
+    } else {
+      return U8Mix(last, repeated, crossfade_);
+    }
+  }
+
+  static T last_sample_[num_channels];
+  static T last_block_[last_block_size];
+  static uint8_t last_block_ptr_;
+  static uint8_t crossfade_;
+
+  DISALLOW_COPY_AND_ASSIGN(UnderrunConcealer);
 };
 
+/* static */
+template<typename Owner, typename T, uint8_t data_size, uint8_t num_channels,
+         uint8_t block_size, UnderrunPolicy underrun_policy>
+T UnderrunConcealer<Owner, T, data_size, num_channels, block_size,
+                    underrun_policy>::last_sample_[num_channels];
+
+/* static */
+template<typename Owner, typename T, uint8_t data_size, uint8_t num_channels,
+         uint8_t block_size, UnderrunPolicy underrun_policy>
+T UnderrunConcealer<Owner, T, data_size, num_channels, block_size,
+                    underrun_policy>::last_block_[last_block_size];
+
+/* static */
+template<typename Owner, typename T, uint8_t data_size, uint8_t num_channels,
+         uint8_t block_size, UnderrunPolicy underrun_policy>
+uint8_t UnderrunConcealer<Owner, T, data_size, num_channels, block_size,
+                          underrun_policy>::last_block_ptr_;
+
+/* static */
+template<typename Owner, typename T, uint8_t data_size, uint8_t num_channels,
+         uint8_t block_size, UnderrunPolicy underrun_policy>
+uint8_t UnderrunConcealer<Owner, T, data_size, num_channels, block_size,
+                          underrun_policy>::crossfade_;
+
 template<typename OutputPort,
          uint8_t buffer_size_ = 32,
          uint8_t block_size = 16,
-         UnderrunPolicy underrun_policy = HOLD_SAMPLE>
-class AudioOutput {
+         UnderrunPolicy underrun_policy = HOLD_SAMPLE,
+         bool fill_histogram = false>
+class AudioOutput : public AudioBufferMonitor<
+    AudioOutput<OutputPort, buffer_size_, block_size, underrun_policy,
+                fill_histogram>,
+    buffer_size_, underrun_policy, fill_histogram> {
  public:
   AudioOutput() { }
   enum {
     buffer_size = buffer_size_,
-    data_size = OutputPort::data_size,
+    data_size = OutputPort::data_size
   };
-  typedef AudioOutput<OutputPort, buffer_size_, block_size, underrun_policy> Me;
+  typedef AudioOutput<OutputPort, buffer_size_, block_size, underrun_policy,
+                      fill_histogram> Me;
   typedef typename DataTypeForSize<data_size>::Type Value;
   typedef RingBuffer<Me> OutputBuffer;
+  typedef AudioBufferMonitor<Me, buffer_size, underrun_policy,
+                             fill_histogram> Monitor;
+  typedef UnderrunConcealer<Me, Value, data_size, 1, block_size,
+                            underrun_policy> Concealer;
 
   static inline void Init() {
     OutputPort::Init();
+    Monitor::Init();
+    Concealer::Init();
   }
 
   static inline void Write(Value v) { while (!writable()); Overwrite(v); }
@@ -72,30 +345,266 @@ class AudioOutput {
 
   // Called from data emission interrupt.
   static inline void EmitSample() {
-    if (OutputBuffer::readable()) {
-      OutputPort::Write(Value(OutputBuffer::ImmediateRead()));
-    } else {
-      ++num_glitches_;
-      if (underrun_policy == EMIT_CLICK) {
-        // Introduces clicks to allow underruns to be easily detected.
-        OutputPort::Write(0);
+    uint8_t level = OutputBuffer::readable();
+    Monitor::Update(level);
+    Value v;
+    if (level) {
+      v = OutputBuffer::ImmediateRead();
+      OutputPort::Write(v);
+      Concealer::Played(&v);
+    } else if (Concealer::Conceal(&v)) {
+      OutputPort::Write(v);
+    }
+  }
+  
+  // Number of samples waiting in the buffer.
+  static inline uint8_t fill_level() { return OutputBuffer::readable(); }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(AudioOutput);
+};
+
+template<typename T, uint8_t num_channels>
+struct AudioFrame {
+  T sample[num_channels];
+};
+
+// Writes the two channels of a frame to two PWM outputs.
+template<typename Left, typename Right>
+struct StereoPwmOutput {
+  enum {
+    buffer_size = 0,
+    data_size = 8,
+    num_channels = 2
+  };
+  typedef AudioFrame<uint8_t, 2> Frame;
+  
+  static inline void Init() {
+    Left::Init();
+    Right::Init();
+  }
+  
+  static inline void Write(const Frame& frame) {
+    Left::Write(frame.sample[0]);
+    Right::Write(frame.sample[1]);
+  }
+};
+
+// Writes the two channels of a frame to a dual DAC (see Dac::WriteStereo).
+template<typename Dac>
+struct StereoDacOutput {
+  enum {
+    buffer_size = 0,
+    data_size = 8,
+    num_channels = 2
+  };
+  typedef AudioFrame<uint8_t, 2> Frame;
+  
+  static inline void Init() {
+    Dac::Init();
+  }
+  
+  static inline void Write(const Frame& frame) {
+    Dac::WriteStereo(frame.sample[0], frame.sample[1]);
+  }
+};
+
+// Same as AudioOutput, but for an OutputPort writing frames of
+// OutputPort::num_channels samples. The channels are interleaved in a single
+// buffer, so there is only one read/write pointer update per frame. The
+// underrun policies are applied to each channel independently.
+template<typename OutputPort,
+         uint8_t buffer_size_ = 32,
+         uint8_t block_size = 16,
+         UnderrunPolicy underrun_policy = HOLD_SAMPLE,
+         bool fill_histogram = false>
+class MultiChannelAudioOutput : public AudioBufferMonitor<
+    MultiChannelAudioOutput<OutputPort, buffer_size_, block_size,
+                            underrun_policy, fill_histogram>,
+    buffer_size_, underrun_policy, fill_histogram> {
+ public:
+  MultiChannelAudioOutput() { }
+  enum {
+    buffer_size = buffer_size_,
+    data_size = OutputPort::data_size,
+    num_channels = OutputPort::num_channels
+  };
+  typedef MultiChannelAudioOutput<OutputPort, buffer_size_, block_size,
+                                  underrun_policy, fill_histogram> Me;
+  typedef typename OutputPort::Frame Frame;
+  typedef Frame Value;
+  typedef typename DataTypeForSize<data_size>::Type Sample;
+  typedef RingBuffer<Me> OutputBuffer;
+  typedef AudioBufferMonitor<Me, buffer_size, underrun_policy,
+                             fill_histogram> Monitor;
+  typedef UnderrunConcealer<Me, Sample, data_size, num_channels, block_size,
+                            underrun_policy> Concealer;
+
+  static inline void Init() {
+    STATIC_ASSERT(sizeof(Frame) == num_channels * sizeof(Sample));
+    OutputPort::Init();
+    Monitor::Init();
+    Concealer::Init();
+  }
+
+  static inline void Write(const Frame& f) { while (!writable()); Overwrite(f); }
+  static inline void Overwrite(const Frame& f) { OutputBuffer::Overwrite(f); }
+
+  static inline uint8_t writable() { return OutputBuffer::writable(); }
+  static inline uint8_t writable_block() {
+    return OutputBuffer::writable() >= block_size;
+  }
+  static inline uint8_t NonBlockingWrite(const Frame& f) {
+    if (!writable()) {
+      return 0;
+    }
+    Overwrite(f);
+    return 1;
+  }
+  
+  static inline void DiscardSample() {
+    OutputBuffer::ImmediateRead();
+  }
+
+  // Called from data emission interrupt.
+  static inline void EmitSample() {
+    uint8_t level = OutputBuffer::readable();
+    Monitor::Update(level);
+    Frame f;
+    if (level) {
+      f = OutputBuffer::ImmediateRead();
+      OutputPort::Write(f);
+      Concealer::Played(f.sample);
+    } else if (Concealer::Conceal(f.sample)) {
+      OutputPort::Write(f);
+    }
+  }
+
+  // Number of frames waiting in the buffer.
+  static inline uint8_t fill_level() { return OutputBuffer::readable(); }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(MultiChannelAudioOutput);
+};
+
+// Calls Audio::EmitSample() at sample_rate from the compare match interrupt
+// of a timer, and raises a flag whenever a block can be rendered.
+//
+// When instrumented is set, the clock counts samples, and the time spent
+// between BeginRender() and EndRender() is measured in samples. A render
+// time close to block_size means that there is no CPU headroom left.
+template<typename Audio,
+         int timer,
+         uint32_t sample_rate,
+         bool instrumented = false>
+class AudioSampleClock {
+ public:
+  typedef PeriodicTimer<timer, sample_rate> SampleTimer;
+
+  AudioSampleClock() { }
+
+  static inline void Init() {
+    Audio::Init();
+    block_needed_ = 1;
+    SampleTimer::Init();
+    SampleTimer::Start();
+  }
+
+  static inline void Start() { SampleTimer::Start(); }
+  static inline void Stop() { SampleTimer::Stop(); }
+
+  // Called from the timer interrupt.
+  static inline void Tick() {
+    Audio::EmitSample();
+    if (instrumented) {
+      ++clock_;
+    }
+    if (Audio::writable_block()) {
+      block_needed_ = 1;
+    }
+  }
+
+  static inline uint8_t block_needed() { return block_needed_; }
+
+  // Renders as many blocks as there is room for in the buffer. Renderer::Render
+  // is expected to write one block of samples.
+  template<typename Renderer>
+  static inline void Fill() {
+    block_needed_ = 0;
+    while (Audio::writable_block()) {
+      BeginRender();
+      Renderer::Render();
+      EndRender();
+    }
+  }
+
+  static inline void BeginRender() {
+    if (instrumented) {
+      render_start_ = clock();
+    }
+  }
+
+  static inline void EndRender() {
+    if (instrumented) {
+      render_time_ = clock() - render_start_;
+      if (render_time_ > max_render_time_) {
+        max_render_time_ = render_time_;
       }
     }
   }
-  static inline uint8_t num_glitches() { return num_glitches_; }
-  static inline void ResetGlitchCounter() { num_glitches_ = 0; }
+
+  // Number of samples emitted since Init(), modulo 65536.
+  static inline uint16_t clock() {
+    uint8_t old_sreg = SREG;
+    cli();
+    uint16_t value = clock_;
+    SREG = old_sreg;
+    return value;
+  }
+
+  // Render time of the last block, and worst render time, in samples.
+  static inline uint16_t render_time() { return render_time_; }
+  static inline uint16_t max_render_time() { return max_render_time_; }
+  static inline void ResetRenderTime() { max_render_time_ = 0; }
 
  private:
-  static uint8_t num_glitches_;
+  static volatile uint8_t block_needed_;
+  static volatile uint16_t clock_;
+  static uint16_t render_start_;
+  static uint16_t render_time_;
+  static uint16_t max_render_time_;
 
-  DISALLOW_COPY_AND_ASSIGN(AudioOutput);
+  DISALLOW_COPY_AND_ASSIGN(AudioSampleClock);
 };
 
 /* static */
-template<typename OutputPort, uint8_t buffer_size_, uint8_t block_size,
-         UnderrunPolicy underrun_policy>
-uint8_t AudioOutput<OutputPort, buffer_size_, block_size,
-                    underrun_policy>::num_glitches_ = 0;
+template<typename Audio, int timer, uint32_t sample_rate, bool instrumented>
+volatile uint8_t AudioSampleClock<Audio, timer, sample_rate,
+                                  instrumented>::block_needed_;
+
+/* static */
+template<typename Audio, int timer, uint32_t sample_rate, bool instrumented>
+volatile uint16_t AudioSampleClock<Audio, timer, sample_rate,
+                                   instrumented>::clock_;
+
+/* static */
+template<typename Audio, int timer, uint32_t sample_rate, bool instrumented>
+uint16_t AudioSampleClock<Audio, timer, sample_rate,
+                          instrumented>::render_start_;
+
+/* static */
+template<typename Audio, int timer, uint32_t sample_rate, bool instrumented>
+uint16_t AudioSampleClock<Audio, timer, sample_rate,
+                          instrumented>::render_time_;
+
+/* static */
+template<typename Audio, int timer, uint32_t sample_rate, bool instrumented>
+uint16_t AudioSampleClock<Audio, timer, sample_rate,
+                          instrumented>::max_render_time_;
+
+// Defines the interrupt handler calling the sample clock.
+#define AUDIO_SAMPLE_CLOCK_ISR(n, SampleClock) \
+  TIMER_##n##_COMPARE { SampleClock::Tick(); }
 
 }  // namespace avrlib
 
@@ -135,7 +135,7 @@ struct Output {
   static inline void Overwrite(Value) { return; }
 
   // Called in data emission interrupt.
-  static inline Value Requested() { return 0; }
+  static inline void Requested() { }
 };
 
 // An object capable both of input and output, composed from an Input and an
@@ -151,7 +151,7 @@ struct InputOutput {
     return O::NonBlockingWrite(v);
   }
   static inline void Overwrite(typename O::Value v) { O::Overwrite(v); }
-  static inline typename O::Value Requested() { return O::Requested(); }
+  static inline void Requested() { O::Requested(); }
   static inline typename I::Value Read() { return I::Read(); }
   static inline uint8_t readable() { return I::readable(); }
   static inline int16_t NonBlockingRead() { return I::NonBlockingRead(); }
@@ -169,7 +169,9 @@ typedef InputOutput<DisabledInput, DisabledOutput> DisabledInputOutput;
 enum PortMode {
   DISABLED = 0,
   POLLED = 1,
-  BUFFERED = 2
+  BUFFERED = 2,
+  // Buffered, and drained by an interrupt handler (serial output only).
+  INTERRUPT_DRIVEN = 3
 };
 
 // Some classes (SPI, shift register) have a notion of communication session -
@@ -44,6 +44,11 @@
 // When Q7, is high, ~Q0 to ~Q6 are controlling the second color.
 //
 // By toggling Q7 rapidly, the two colors can be displayed simultaneously.
+//
+// The PWM cycle is made of 32 frames (16 PWM steps for each color). The
+// contents of the shift registers for each frame are computed when the pixels
+// are modified (in Sync() or set_direct_pixel()), so the refresh only has to
+// shift out pre-packed bytes. This costs 32 bytes of RAM per shift register.
 
 #ifndef AVRLIB_DEVICES_BICOLOR_LED_ARRAY_H_
 #define AVRLIB_DEVICES_BICOLOR_LED_ARRAY_H_
@@ -55,11 +60,13 @@
 
 namespace avrlib {
 
-template<typename Latch, typename Clock, typename Data, uint8_t num_regs = 1>
+template<typename Latch, typename Clock, typename Data, uint8_t num_regs = 1,
+         ShiftRegisterBackend backend = SHIFT_REGISTER_GPIO>
 class BicolorLedArray {
  public:
   enum {
-    size = num_regs * 8 - 1
+    size = num_regs * 8 - 1,
+    num_frames = 32
   };
    
   BicolorLedArray() { }
@@ -67,6 +74,8 @@ class BicolorLedArray {
   static inline void Init() {
     Register::Init();
     Clear();
+    memset(pixels_, 0, size);
+    EncodeFrames();
   }
   
   // Intensity is in AAAABBBB format, where AAAA is the intensity for the
@@ -77,6 +86,17 @@ class BicolorLedArray {
 
   static inline void set_direct_pixel(uint8_t index, uint8_t intensity) {
     pixels_[index] = intensity;
+    // Pixel i is shifted out at position size - i, after the color bit.
+    uint8_t position = size - index;
+    uint8_t mask = 0x80 >> (position & 7);
+    uint8_t reg = position >> 3;
+    for (uint8_t frame = 0; frame < num_frames; ++frame) {
+      if (lit(intensity, frame)) {
+        frames_[frame][reg] |= mask;
+      } else {
+        frames_[frame][reg] &= ~mask;
+      }
+    }
   }
   
   static inline uint8_t pixel(uint8_t index) {
@@ -100,33 +120,19 @@ class BicolorLedArray {
   }
   
   static inline void Sync() {
+    if (!memcmp(pixels_, buffered_pixels_, size)) {
+      return;
+    }
     memcpy(pixels_, buffered_pixels_, size);
+    EncodeFrames();
   }
   
   static inline void ShiftOutPixels() {
-    uint8_t threshold = refresh_cycle_ & 0x0f;
-    uint8_t color = refresh_cycle_ & 0x20 ? 1 : 0;
-    
-    uint8_t byte = color;
-    uint8_t num_bits = 1;
-    
-    for (uint8_t i = (num_regs * 8) - 2; i != 0xff ; --i) {
-      byte <<= 1;
-      uint8_t intensity;
-      if (color) {
-        intensity = U8ShiftRight4(~pixels_[i]);
-      } else {
-        intensity = pixels_[i] & 0x0f;
-      }
-      if (intensity > threshold || intensity == 0xf) {
-        byte |= 1;
-      }
-      ++num_bits;
-      if (num_bits == 8) {
-        Register::ShiftOut(byte);
-        num_bits = 0;
-        byte = 0;
-      }
+    // Each PWM step lasts for 2 refreshes.
+    uint8_t frame = (refresh_cycle_ & 0x0f) | ((refresh_cycle_ & 0x20) >> 1);
+    const uint8_t* data = frames_[frame];
+    for (uint8_t i = 0; i < num_regs; ++i) {
+      Register::ShiftOut(data[i]);
     }
     ++refresh_cycle_;
   }
@@ -140,23 +146,65 @@ class BicolorLedArray {
   uint8_t* pixels() { return buffered_pixels_; }
   
  private:
-  typedef ShiftRegisterOutput<Latch, Clock, Data, 8, MSB_FIRST> Register;
+  typedef ShiftRegisterOutput<
+      Latch, Clock, Data, 8, MSB_FIRST, backend> Register;
+  
+  // Frames 0 to 15 show the first color, frames 16 to 31 the second color,
+  // with the PWM threshold in the lower 4 bits of the frame number.
+  static inline uint8_t lit(uint8_t pixel, uint8_t frame) {
+    uint8_t threshold = frame & 0x0f;
+    uint8_t intensity;
+    if (frame & 0x10) {
+      intensity = U8ShiftRight4(~pixel);
+    } else {
+      intensity = pixel & 0x0f;
+    }
+    return intensity > threshold || intensity == 0xf;
+  }
+  
+  static void EncodeFrames() {
+    for (uint8_t frame = 0; frame < num_frames; ++frame) {
+      uint8_t byte = frame & 0x10 ? 1 : 0;
+      uint8_t num_bits = 1;
+      uint8_t* data = frames_[frame];
+      for (uint8_t i = size - 1; i != 0xff ; --i) {
+        byte <<= 1;
+        if (lit(pixels_[i], frame)) {
+          byte |= 1;
+        }
+        ++num_bits;
+        if (num_bits == 8) {
+          *data++ = byte;
+          num_bits = 0;
+          byte = 0;
+        }
+      }
+    }
+  }
 
   static uint8_t buffered_pixels_[size];
   static uint8_t pixels_[size];
+  static uint8_t frames_[num_frames][num_regs];
   static uint8_t refresh_cycle_;
 
   DISALLOW_COPY_AND_ASSIGN(BicolorLedArray);
 };
 
-template<typename Latch, typename Clock, typename Data, uint8_t num_regs>
-uint8_t BicolorLedArray<Latch, Clock, Data, num_regs>::pixels_[size];
+template<typename Latch, typename Clock, typename Data, uint8_t num_regs,
+         ShiftRegisterBackend backend>
+uint8_t BicolorLedArray<Latch, Clock, Data, num_regs, backend>::pixels_[size];
+
+template<typename Latch, typename Clock, typename Data, uint8_t num_regs,
+         ShiftRegisterBackend backend>
+uint8_t BicolorLedArray<Latch, Clock, Data, num_regs, backend>::buffered_pixels_[size];
 
-template<typename Latch, typename Clock, typename Data, uint8_t num_regs>
-uint8_t BicolorLedArray<Latch, Clock, Data, num_regs>::buffered_pixels_[size];
+template<typename Latch, typename Clock, typename Data, uint8_t num_regs,
+         ShiftRegisterBackend backend>
+uint8_t BicolorLedArray<Latch, Clock, Data, num_regs, backend>::frames_[num_frames][num_regs];
 
-template<typename Latch, typename Clock, typename Data, uint8_t num_regs>
-uint8_t BicolorLedArray<Latch, Clock, Data, num_regs>::refresh_cycle_;
+template<typename Latch, typename Clock, typename Data, uint8_t num_regs,
+         ShiftRegisterBackend backend>
+uint8_t BicolorLedArray<Latch, Clock, Data, num_regs, backend>::refresh_cycle_;
 
 }  // namespace avrlib
 
@@ -22,10 +22,27 @@
 // containing the requested text page. The 2 buffer are compared in a background
 // process and differences are sent to the LCD display. This also manages a
 // software blinking cursor.
+//
+// The page is divided in chunks of 8 characters, and a chunk is marked as
+// dirty whenever something is written in it. The background process skips
+// clean chunks, and does nothing when the whole page is clean.
+//
+// Code writing directly to the text page should use EditLine(), then call
+// CommitLine() once the writes are done, to mark the line as dirty. Tick() may
+// run between the two: the chunks it has scanned in the meantime are scanned
+// again after the commit. line_buffer() returns a pointer which can be kept and
+// written to at any time, at the cost of disabling the dirty chunk tracking:
+// once it has been called, the whole page is scanned again and again, one
+// character at a time, until set_scan_all(0) is called.
+//
+// With max_burst > 1, each call to Tick() transmits a run of up to max_burst
+// consecutive modified characters on the same line, with a single cursor move
+// command, as long as there is room in the LCD output buffer.
 
 #ifndef AVRLIB_DEVICES_BUFFERED_DISPLAY_H_
 #define AVRLIB_DEVICES_BUFFERED_DISPLAY_H_
 
+#include <avr/interrupt.h>
 #include <string.h>
 
 #include "avrlib/base.h"
@@ -39,13 +56,14 @@ static const uint8_t kLcdNoCursor = 0xff;
 static const uint8_t kLcdCursor = 0xff;
 static const uint8_t kLcdEditCursor = '_';
 
-template<typename Lcd>
+template<typename Lcd, uint8_t max_burst = 1>
 class BufferedDisplay {
  public:
   enum {
     width = Lcd::lcd_width,
     height = Lcd::lcd_height,
     lcd_buffer_size = width * height,
+    num_chunks = (lcd_buffer_size + 7) >> 3,
   };
 
   BufferedDisplay() { }
@@ -59,34 +77,59 @@ class BufferedDisplay {
     scan_position_last_write_ = 255;
     cursor_position_ = 255;
     blink_ = 0;
+    scan_all_ = 0;
+    MarkAllDirty();
   }
   
   static char* line_buffer(uint8_t line) {
+    scan_all_ = 1;
+    return EditLine(line);
+  }
+
+  // To call when no pointer returned by line_buffer() is written to anymore,
+  // to resume the dirty chunk tracking.
+  static inline void set_scan_all(uint8_t scan_all) {
+    scan_all_ = scan_all;
+    MarkAllDirty();
+  }
+
+  static char* EditLine(uint8_t line) {
     return static_cast<char*>(
         static_cast<void*>(local_ + U8U8Mul(line, width)));
   }
 
+  static inline void CommitLine(uint8_t line) {
+    MarkLineDirty(line);
+  }
+
   static void Print(uint8_t line, const char* text) {
     uint8_t row = width;
-    char* destination = line_buffer(line);
+    char* destination = EditLine(line);
     while (*text && row) {
       *destination++ = *text;
       ++text;
       --row;
     }
+    MarkLineDirty(line);
   }
   
   static void Clear() {
     memset(local_, ' ', lcd_buffer_size);
+    MarkAllDirty();
   }
 
   // Use kLcdNoCursor (255) or any other value outside of the screen to hide.
   static inline void set_cursor_position(uint8_t cursor) {
-    cursor_position_ = cursor;
+    if (cursor != cursor_position_) {
+      MarkDirty(cursor_position_);
+      MarkDirty(cursor);
+      cursor_position_ = cursor;
+    }
   }
 
   static inline void set_cursor_character(uint8_t character) {
     cursor_character_ = character;
+    MarkDirty(cursor_position_);
   }
   
   static inline uint8_t cursor_position() {
@@ -97,6 +140,7 @@ class BufferedDisplay {
     status_ = status + 1;
     Lcd::ResetStatusCounter();
     previous_status_counter_ = 0;
+    MarkStatusDirty();
   }
   
   static inline void ForceStatus(uint8_t status) {
@@ -104,16 +148,55 @@ class BufferedDisplay {
       return;
     }
     status_ = status + 1;
+    // The scan of the current chunk is interrupted, so it has to be scanned
+    // again later.
+    if (scan_position_ & 7) {
+      MarkDirty(scan_position_);
+    }
     scan_position_ = 0;
     scan_row_ = 0;
     scan_column_ = 0;
     Lcd::MoveCursor(scan_row_, scan_column_);
     Lcd::WriteData(status_ - 1);
     remote_[scan_position_] = status_ - 1;
+    // The LCD address counter now points after the status character.
+    scan_position_last_write_ = scan_position_;
+    MarkStatusDirty();
+  }
+  
+  // Bitmask of the custom characters (CGRAM slots) which are either shown on
+  // the display, or about to be shown. Characters 0-7 and 8-15 both refer to
+  // the 8 custom characters.
+  static uint8_t referenced_glyphs() {
+    uint8_t referenced = 0;
+    for (uint8_t i = 0; i < lcd_buffer_size; ++i) {
+      if (local_[i] < 16) {
+        referenced |= 1 << (local_[i] & 7);
+      }
+      if (remote_[i] < 16) {
+        referenced |= 1 << (remote_[i] & 7);
+      }
+    }
+    if (cursor_character_ < 16) {
+      referenced |= 1 << (cursor_character_ & 7);
+    }
+    if (status_ && status_ <= 16) {
+      referenced |= 1 << ((status_ - 1) & 7);
+    }
+    return referenced;
+  }
+  
+  // To call when something else than this class has moved the LCD address
+  // counter: the next character will be written after an explicit cursor move.
+  static inline void ForceCursorMove() {
+    scan_position_last_write_ = 255;
   }
   
   static void BlinkCursor() {
     ++blink_;
+    if (!(blink_ & 0x7f)) {
+      MarkDirty(cursor_position_);
+    }
   }
 
   static void Tick() {
@@ -128,62 +211,171 @@ class BufferedDisplay {
     
     if (previous_status_counter_ > Lcd::status_counter()) {
       status_ = 0;
+      MarkStatusDirty();
     }
     previous_status_counter_ = Lcd::status_counter();
-
-    uint8_t character = 0;
-    // Determine which character to show at the current position.
-    // If the scan position is the cursor and it is shown (blinking), draw the
-    // cursor.
-    if (scan_position_ == cursor_position_ && (blink_ & 128)) {
-      character = cursor_character_;
-    } else {
-      // Otherwise, check if there's a status indicator to display. It is
-      // displayed either on the left or right of the first line, depending on
-      // the available space.
-      if (status_ && (scan_position_ == 0 || scan_position_ == (width - 1)) &&
-          local_[scan_position_] == ' ') {
-        character = status_ - 1;
-      } else {
-        character = local_[scan_position_];
+    
+    // At the beginning of a chunk, move to the next dirty chunk, or stop here
+    // if there's none. The chunk is marked as clean before it is scanned, so
+    // that writes happening during the scan are not missed.
+    if ((scan_position_ & 7) == 0) {
+      uint8_t chunk = scan_position_ >> 3;
+      uint8_t i = num_chunks;
+      while (!scan_all_ && !(dirty_[chunk >> 3] & (1 << (chunk & 7)))) {
+        if (!--i) {
+          return;
+        }
+        ++chunk;
+        if (chunk == num_chunks) {
+          chunk = 0;
+        }
+      }
+      dirty_[chunk >> 3] &= ~(1 << (chunk & 7));
+      if (scan_position_ != chunk << 3) {
+        scan_position_ = chunk << 3;
+        scan_row_ = scan_position_ / width;
+        scan_column_ = scan_position_ - U8U8Mul(scan_row_, width);
       }
     }
-    // Check whether the screen really has to be updated to show the character.
-    if (character != remote_[scan_position_]) {
-      // There is a character to transmit!
-      // If the new character to transmit is just after the previous one, and on
-      // the same line, we're good, we don't need to reposition the cursor.
-      if ((scan_position_ == scan_position_last_write_ + 1) && scan_column_) {
-        // We use overwrite because we have checked before that there is
-        // enough room in the buffer.
-        Lcd::WriteData(character);
-      } else {
-        // The character to transmit is at a different position, we need to move
-        // the cursor, and determine the cursor move command argument.
-        Lcd::MoveCursor(scan_row_, scan_column_);
-        Lcd::WriteData(character);
+
+    // Transmit the run of modified characters starting at the current
+    // position, up to max_burst characters. Only the first character of the
+    // run might need a cursor move, the following ones are written at the
+    // next address by the auto-increment of the LCD controller. The run stops
+    // at the end of a line, or when the output buffer is full.
+    uint8_t num_written = 0;
+    while (1) {
+      uint8_t character = DisplayedCharacter(scan_position_);
+      // Check whether the screen really has to be updated to show the
+      // character.
+      uint8_t modified = character != remote_[scan_position_];
+      if (modified) {
+        // There is a character to transmit!
+        // If the new character to transmit is just after the previous one,
+        // and on the same line, we're good, we don't need to reposition the
+        // cursor.
+        if ((scan_position_ == scan_position_last_write_ + 1) && scan_column_) {
+          // We use overwrite because we have checked before that there is
+          // enough room in the buffer.
+          Lcd::WriteData(character);
+        } else {
+          // The character to transmit is at a different position, we need to
+          // move the cursor, and determine the cursor move command argument.
+          Lcd::MoveCursor(scan_row_, scan_column_);
+          Lcd::WriteData(character);
+          ++bytes_sent_;
+        }
+        ++bytes_sent_;
+        ++cells_changed_;
+        // We can now assume that the remote display will be updated.
+        remote_[scan_position_] = character;
+        scan_position_last_write_ = scan_position_;
+        ++num_written;
       }
-      // We can now assume that the remote display will be updated.
-      remote_[scan_position_] = character;
-      scan_position_last_write_ = scan_position_;
-    }
-    ++scan_column_;
-    ++scan_position_;
-    if (scan_column_ == width) {
-      scan_column_ = 0;
-      ++scan_row_;
-      if (scan_row_ == height) {
-        scan_row_ = 0;
-        scan_position_ = 0;
+      ++scan_column_;
+      ++scan_position_;
+      if (scan_column_ == width) {
+        scan_column_ = 0;
+        ++scan_row_;
+        if (scan_row_ == height) {
+          scan_row_ = 0;
+          scan_position_ = 0;
+        }
+      }
+      if (!modified || num_written >= max_burst || scan_column_ == 0 ||
+          Lcd::writable() < 2) {
+        break;
+      }
+      // The run continues into the next chunk. It is scanned from its
+      // beginning, so it can be marked as clean right now - unless it was
+      // clean already, in which case there's nothing more to write.
+      if ((scan_position_ & 7) == 0) {
+        uint8_t chunk = scan_position_ >> 3;
+        uint8_t mask = 1 << (chunk & 7);
+        if (!scan_all_ && !(dirty_[chunk >> 3] & mask)) {
+          break;
+        }
+        dirty_[chunk >> 3] &= ~mask;
       }
     }
   }
 
+  // Number of bytes (commands and data) sent to the display, and number of
+  // characters updated on the display. Tick() is usually called from an
+  // interrupt, so the counters are read with interrupts disabled.
+  static inline uint16_t bytes_sent() {
+    uint8_t old_sreg = SREG;
+    cli();
+    uint16_t value = bytes_sent_;
+    SREG = old_sreg;
+    return value;
+  }
+  static inline uint16_t cells_changed() {
+    uint8_t old_sreg = SREG;
+    cli();
+    uint16_t value = cells_changed_;
+    SREG = old_sreg;
+    return value;
+  }
+  static inline void ResetStatistics() {
+    uint8_t old_sreg = SREG;
+    cli();
+    bytes_sent_ = 0;
+    cells_changed_ = 0;
+    SREG = old_sreg;
+  }
+
  private:
+  static inline uint8_t DisplayedCharacter(uint8_t position) {
+    // If the position is the cursor and it is shown (blinking), draw the
+    // cursor.
+    if (position == cursor_position_ && (blink_ & 128)) {
+      return cursor_character_;
+    }
+    // Otherwise, check if there's a status indicator to display. It is
+    // displayed either on the left or right of the first line, depending on
+    // the available space.
+    if (status_ && (position == 0 || position == (width - 1)) &&
+        local_[position] == ' ') {
+      return status_ - 1;
+    }
+    return local_[position];
+  }
+
+  static inline void MarkDirty(uint8_t position) {
+    if (position < lcd_buffer_size) {
+      uint8_t chunk = position >> 3;
+      dirty_[chunk >> 3] |= (1 << (chunk & 7));
+    }
+  }
+  
+  static void MarkLineDirty(uint8_t line) {
+    uint8_t first = U8U8Mul(line, width);
+    uint8_t last = first + width - 1;
+    for (uint8_t chunk = first >> 3; chunk <= (last >> 3); ++chunk) {
+      dirty_[chunk >> 3] |= (1 << (chunk & 7));
+    }
+  }
+  
+  static inline void MarkAllDirty() {
+    memset(dirty_, 0xff, sizeof(dirty_));
+  }
+  
+  static inline void MarkStatusDirty() {
+    MarkDirty(0);
+    MarkDirty(width - 1);
+  }
+
   // Character pages storing what the display currently shows (remote), and
   // what it ought to show (local).
   static uint8_t local_[width * height + 1];
   static uint8_t remote_[width * height];
+  
+  // One bit per chunk of 8 characters which might need to be updated.
+  static uint8_t dirty_[(num_chunks + 7) >> 3];
+  
+  // Set when line_buffer() has been called, until set_scan_all(0).
+  static uint8_t scan_all_;
 
   // Position of the last character being transmitted.
   static uint8_t scan_position_;
@@ -196,53 +388,72 @@ class BufferedDisplay {
   static uint8_t cursor_position_;
   static uint8_t cursor_character_;
   static uint8_t status_;
+  
+  static volatile uint16_t bytes_sent_;
+  static volatile uint16_t cells_changed_;
 
   DISALLOW_COPY_AND_ASSIGN(BufferedDisplay);
 };
 
 /* static */
-template<typename Lcd>
-uint8_t BufferedDisplay<Lcd>::local_[width * height + 1];
+template<typename Lcd, uint8_t max_burst>
+uint8_t BufferedDisplay<Lcd, max_burst>::local_[width * height + 1];
+
+/* static */
+template<typename Lcd, uint8_t max_burst>
+uint8_t BufferedDisplay<Lcd, max_burst>::remote_[width * height];
+
+/* static */
+template<typename Lcd, uint8_t max_burst>
+uint8_t BufferedDisplay<Lcd, max_burst>::dirty_[(num_chunks + 7) >> 3];
+
+/* static */
+template<typename Lcd, uint8_t max_burst>
+uint8_t BufferedDisplay<Lcd, max_burst>::scan_all_;
+
+/* static */
+template<typename Lcd, uint8_t max_burst>
+uint8_t BufferedDisplay<Lcd, max_burst>::scan_position_;
 
 /* static */
-template<typename Lcd>
-uint8_t BufferedDisplay<Lcd>::remote_[width * height];
+template<typename Lcd, uint8_t max_burst>
+uint8_t BufferedDisplay<Lcd, max_burst>::scan_row_;
 
 /* static */
-template<typename Lcd>
-uint8_t BufferedDisplay<Lcd>::scan_position_;
+template<typename Lcd, uint8_t max_burst>
+uint8_t BufferedDisplay<Lcd, max_burst>::scan_column_;
 
 /* static */
-template<typename Lcd>
-uint8_t BufferedDisplay<Lcd>::scan_row_;
+template<typename Lcd, uint8_t max_burst>
+uint8_t BufferedDisplay<Lcd, max_burst>::scan_position_last_write_;
 
 /* static */
-template<typename Lcd>
-uint8_t BufferedDisplay<Lcd>::scan_column_;
+template<typename Lcd, uint8_t max_burst>
+uint8_t BufferedDisplay<Lcd, max_burst>::blink_;
 
 /* static */
-template<typename Lcd>
-uint8_t BufferedDisplay<Lcd>::scan_position_last_write_;
+template<typename Lcd, uint8_t max_burst>
+uint8_t BufferedDisplay<Lcd, max_burst>::previous_status_counter_;
 
 /* static */
-template<typename Lcd>
-uint8_t BufferedDisplay<Lcd>::blink_;
+template<typename Lcd, uint8_t max_burst>
+uint8_t BufferedDisplay<Lcd, max_burst>::cursor_position_;
 
 /* static */
-template<typename Lcd>
-uint8_t BufferedDisplay<Lcd>::previous_status_counter_;
+template<typename Lcd, uint8_t max_burst>
+uint8_t BufferedDisplay<Lcd, max_burst>::cursor_character_ = kLcdCursor;
 
 /* static */
-template<typename Lcd>
-uint8_t BufferedDisplay<Lcd>::cursor_position_;
+template<typename Lcd, uint8_t max_burst>
+uint8_t BufferedDisplay<Lcd, max_burst>::status_;
 
 /* static */
-template<typename Lcd>
-uint8_t BufferedDisplay<Lcd>::cursor_character_ = kLcdCursor;
+template<typename Lcd, uint8_t max_burst>
+volatile uint16_t BufferedDisplay<Lcd, max_burst>::bytes_sent_;
 
 /* static */
-template<typename Lcd>
-uint8_t BufferedDisplay<Lcd>::status_;
+template<typename Lcd, uint8_t max_burst>
+volatile uint16_t BufferedDisplay<Lcd, max_burst>::cells_changed_;
 
 }  // namespace avrlib
 
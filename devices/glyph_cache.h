@@ -0,0 +1,133 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Cache of the 8 custom characters of a HD44780 display.
+//
+// Glyphs are identified by the address of their 8 bytes bitmap in program
+// memory. Acquire() returns the character code under which a glyph can be
+// printed with BufferedDisplay, uploading it to the CGRAM only if it is not
+// already loaded. When all slots are taken, the least recently acquired glyph
+// not used by any character on the page (or still on the display) is replaced.
+//
+// The character codes returned are in the 8-15 range (the HD44780 maps them to
+// the same CGRAM slots as 0-7), so that they can be used in null-terminated
+// strings.
+
+#ifndef AVRLIB_DEVICES_GLYPH_CACHE_H_
+#define AVRLIB_DEVICES_GLYPH_CACHE_H_
+
+#include <avr/interrupt.h>
+
+#include "avrlib/base.h"
+
+namespace avrlib {
+
+static const uint8_t kLcdNoGlyph = 0xff;
+
+template<typename Lcd, typename Display>
+class GlyphCache {
+ public:
+  enum {
+    num_slots = 8
+  };
+
+  GlyphCache() { }
+
+  static void Init() {
+    for (uint8_t i = 0; i < num_slots; ++i) {
+      glyph_[i] = NULL;
+      lru_[i] = i;
+    }
+    num_uploads_ = 0;
+  }
+
+  // Returns kLcdNoGlyph if the glyph is not loaded and can't be loaded right
+  // now: all slots are used on the display, or the LCD output buffer is full.
+  // The caller can display a replacement character and try again later.
+  static uint8_t Acquire(const prog_uint8_t* glyph) {
+    uint8_t rank = 0;
+    while (rank < num_slots && glyph_[lru_[rank]] != glyph) {
+      ++rank;
+    }
+    if (rank == num_slots) {
+      // Not loaded. Find, starting from the least recently used slot, a slot
+      // which is not referenced on the page. Display::Tick() must not run
+      // between the upload and ForceCursorMove(), or it could write a
+      // character at the CGRAM address left by the upload.
+      uint8_t old_sreg = SREG;
+      cli();
+      uint8_t referenced = Display::referenced_glyphs();
+      do {
+        if (!rank) {
+          SREG = old_sreg;
+          return kLcdNoGlyph;
+        }
+        --rank;
+      } while (referenced & (1 << lru_[rank]));
+      if (!Lcd::WriteCustomChar(glyph, lru_[rank])) {
+        SREG = old_sreg;
+        return kLcdNoGlyph;
+      }
+      Display::ForceCursorMove();
+      SREG = old_sreg;
+      glyph_[lru_[rank]] = glyph;
+      ++num_uploads_;
+    }
+    // Move the slot to the front of the LRU list.
+    uint8_t slot = lru_[rank];
+    while (rank) {
+      lru_[rank] = lru_[rank - 1];
+      --rank;
+    }
+    lru_[0] = slot;
+    return slot | 8;
+  }
+
+  // To call after the CGRAM has been written by other means (for example with
+  // Lcd::SetCustomCharMap).
+  static inline void Invalidate() {
+    Init();
+  }
+
+  static inline uint16_t num_uploads() { return num_uploads_; }
+
+ private:
+  static const prog_uint8_t* glyph_[num_slots];
+  
+  // Slot indices, from the most recently to the least recently acquired.
+  static uint8_t lru_[num_slots];
+  
+  static uint16_t num_uploads_;
+
+  DISALLOW_COPY_AND_ASSIGN(GlyphCache);
+};
+
+/* static */
+template<typename Lcd, typename Display>
+const prog_uint8_t* GlyphCache<Lcd, Display>::glyph_[num_slots];
+
+/* static */
+template<typename Lcd, typename Display>
+uint8_t GlyphCache<Lcd, Display>::lru_[num_slots];
+
+/* static */
+template<typename Lcd, typename Display>
+uint16_t GlyphCache<Lcd, Display>::num_uploads_;
+
+}  // namespace avrlib
+
+#endif  // AVRLIB_DEVICES_GLYPH_CACHE_H_
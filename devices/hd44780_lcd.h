@@ -16,11 +16,27 @@
 // -----------------------------------------------------------------------------
 //
 // Driver for a HD44780 LCD display.
+//
+// When the R/W pin of the display is not connected (RwPin = DummyGpio), the
+// output buffer is drained by Tick() at a rate of one nibble every two calls,
+// and Tick() must be called at a rate slow enough for the display to process
+// the data. When the R/W pin is connected, each call to Tick() reads the busy
+// flag of the display and sends a whole byte as soon as it is ready, so Tick()
+// can be called at a high rate from a timer interrupt. The initialization
+// and custom character upload routines also wait for the busy flag instead of
+// using fixed delays.
+//
+// In busy flag mode, Tick() spins in _delay_us() for about 7us when a byte is
+// sent (3us to read the busy flag, 2us per nibble), and 3us when the display
+// is busy. This time is spent inside the interrupt handler calling Tick().
 
 #ifndef AVRLIB_DEVICES_HD44780_LCD_H_
 #define AVRLIB_DEVICES_HD44780_LCD_H_
 
+#include <avr/interrupt.h>
+
 #include "avrlib/base.h"
+#include "avrlib/gpio.h"
 #include "avrlib/log2.h"
 #include "avrlib/software_serial.h"
 #include "avrlib/time.h"
@@ -64,11 +80,22 @@ enum LCD_FLAGS {
   LCD_SMALL_FONT = 0x00,
 };
 
+template<typename Pin>
+struct IsConnected {
+  enum { value = 1 };
+};
+
+template<>
+struct IsConnected<DummyGpio> {
+  enum { value = 0 };
+};
+
 template<typename RsPin,
          typename EnablePin,
          typename ParallelPort,
          uint8_t width = 16,
-         uint8_t height = 2>
+         uint8_t height = 2,
+         typename RwPin = DummyGpio>
 class Hd44780Lcd {
  public:
   enum {
@@ -79,7 +106,11 @@ class Hd44780Lcd {
     lcd_width = width,
     lcd_height = height,
   };
-  typedef Hd44780Lcd<RsPin, EnablePin, ParallelPort, width, height> Me;
+  enum {
+    has_busy_flag = IsConnected<RwPin>::value
+  };
+  typedef Hd44780Lcd<RsPin, EnablePin, ParallelPort, width, height,
+                     RwPin> Me;
   typedef typename DataTypeForSize<data_size>::Type Value;
   typedef RingBuffer<Me> OutputBuffer;
 
@@ -88,10 +119,12 @@ class Hd44780Lcd {
   static inline void Init() {
     RsPin::set_mode(DIGITAL_OUTPUT);
     EnablePin::set_mode(DIGITAL_OUTPUT);
+    RwPin::set_mode(DIGITAL_OUTPUT);
     ParallelPort::set_mode(DIGITAL_OUTPUT);
 
     RsPin::Low();
     EnablePin::Low();
+    RwPin::Low();
 
     ConstantDelay(100);  // Wait for warm up
 
@@ -113,13 +146,26 @@ class Hd44780Lcd {
     SlowCommand(LCD_CLEAR);
     SlowCommand(LCD_HOME);
     transmitting_ = 0;
+    num_bytes_sent_ = 0;
   }
 
   static inline void Tick() {
     ++status_counter_;
+    if (has_busy_flag) {
+      // Bytes are always written to the buffer as pairs of nibbles.
+      if (OutputBuffer::readable() && !ReadBusyFlag()) {
+        Strobe(OutputBuffer::ImmediateRead());
+        Strobe(OutputBuffer::ImmediateRead());
+        ++num_bytes_sent_;
+      }
+      return;
+    }
     if (transmitting_) {
       EndWrite();
       transmitting_ = 0;
+      if (!(OutputBuffer::readable() & 1)) {
+        ++num_bytes_sent_;
+      }
     } else {
       if (OutputBuffer::readable()) {
         transmitting_ = 1;
@@ -167,6 +213,21 @@ class Hd44780Lcd {
     }
   }
 
+  // Queues the upload of a 5x8 glyph stored in program memory to one of the 8
+  // CGRAM slots. Returns 0 if there is not enough room in the output buffer.
+  // The cursor must be moved before the next character is written, since the
+  // LCD address counter points to the CGRAM after this.
+  static uint8_t WriteCustomChar(const prog_uint8_t* data, uint8_t slot) {
+    if (OutputBuffer::writable() < 18) {
+      return 0;
+    }
+    WriteCommand(LCD_SET_CGRAM_ADDRESS | (slot << 3));
+    for (uint8_t i = 0; i < 8; ++i) {
+      WriteData(SimpleResourcesManager::Lookup<uint8_t, uint8_t>(data, i));
+    }
+    return 1;
+  }
+
   static inline void SetCustomCharMapRes(
       const uint8_t* data,
       uint8_t num_characters,
@@ -190,6 +251,22 @@ class Hd44780Lcd {
   static inline uint8_t status_counter() { return status_counter_; }
   
   static inline void ResetStatusCounter() { status_counter_ = 0; }
+  
+  // Number of bytes transmitted to the display. Sample it at regular intervals
+  // (for example with milliseconds()) to measure the throughput.
+  static inline uint16_t num_bytes_sent() {
+    uint8_t old_sreg = SREG;
+    cli();
+    uint16_t value = num_bytes_sent_;
+    SREG = old_sreg;
+    return value;
+  }
+  static inline void ResetStatistics() {
+    uint8_t old_sreg = SREG;
+    cli();
+    num_bytes_sent_ = 0;
+    SREG = old_sreg;
+  }
 
  private:
   static inline void StartWrite(uint8_t nibble) {
@@ -205,6 +282,31 @@ class Hd44780Lcd {
     RsPin::Low();
   }
 
+  static inline void Strobe(uint8_t nibble) {
+    StartWrite(nibble);
+    _delay_us(1);
+    EndWrite();
+    _delay_us(1);
+  }
+  
+  static uint8_t ReadBusyFlag() {
+    // In 4-bit mode, the busy flag is the MSB of the first nibble read. The
+    // second nibble (address counter) is read and ignored.
+    ParallelPort::set_mode(DIGITAL_INPUT);
+    RwPin::High();
+    EnablePin::High();
+    _delay_us(1);
+    uint8_t busy = ParallelPort::Read() & 0x08;
+    EnablePin::Low();
+    _delay_us(1);
+    EnablePin::High();
+    _delay_us(1);
+    EnablePin::Low();
+    RwPin::Low();
+    ParallelPort::set_mode(DIGITAL_OUTPUT);
+    return busy;
+  }
+  
   static void SlowWrite(uint8_t nibble) {
     StartWrite(nibble);
     ConstantDelay(1);
@@ -213,32 +315,51 @@ class Hd44780Lcd {
   }
   
   static void SlowCommand(uint8_t value) {
-    SlowWrite(LCD_COMMAND | (value >> 4));
-    SlowWrite(LCD_COMMAND | (value & 0x0f));
+    if (has_busy_flag) {
+      while (ReadBusyFlag());
+      Strobe(LCD_COMMAND | (value >> 4));
+      Strobe(LCD_COMMAND | (value & 0x0f));
+    } else {
+      SlowWrite(LCD_COMMAND | (value >> 4));
+      SlowWrite(LCD_COMMAND | (value & 0x0f));
+    }
   }
   
   static void SlowData(uint8_t value) {
-    SlowWrite(LCD_DATA | (value >> 4));
-    SlowWrite(LCD_DATA | (value & 0x0f));
+    if (has_busy_flag) {
+      while (ReadBusyFlag());
+      Strobe(LCD_DATA | (value >> 4));
+      Strobe(LCD_DATA | (value & 0x0f));
+    } else {
+      SlowWrite(LCD_DATA | (value >> 4));
+      SlowWrite(LCD_DATA | (value & 0x0f));
+    }
   }
 
   static volatile uint8_t transmitting_;
   static volatile uint8_t status_counter_;
+  static volatile uint16_t num_bytes_sent_;
 
   DISALLOW_COPY_AND_ASSIGN(Hd44780Lcd);
 };
 
 /* static */
 template<typename RsPin, typename EnablePin, typename ParallelPort,
-         uint8_t width, uint8_t height>
+         uint8_t width, uint8_t height, typename RwPin>
 volatile uint8_t Hd44780Lcd<RsPin, EnablePin, ParallelPort, width,
-                            height>::transmitting_;
+                            height, RwPin>::transmitting_;
 
 /* static */
 template<typename RsPin, typename EnablePin, typename ParallelPort,
-         uint8_t width, uint8_t height>
+         uint8_t width, uint8_t height, typename RwPin>
 volatile uint8_t Hd44780Lcd<RsPin, EnablePin, ParallelPort, width,
-                            height>::status_counter_;
+                            height, RwPin>::status_counter_;
+
+/* static */
+template<typename RsPin, typename EnablePin, typename ParallelPort,
+         uint8_t width, uint8_t height, typename RwPin>
+volatile uint16_t Hd44780Lcd<RsPin, EnablePin, ParallelPort, width,
+                             height, RwPin>::num_bytes_sent_;
 
 }  // namespace avrlib
 
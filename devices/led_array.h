@@ -17,6 +17,20 @@
 // -----------------------------------------------------------------------------
 //
 // Driver for an array of LEDs behind shift registers.
+//
+// Two modulation schemes are available for the 16 intensity levels:
+//
+// - LED_MODULATION_PWM: at each refresh, each pixel is compared to a threshold
+// incremented at each refresh. A full PWM cycle takes 16 refreshes, each of
+// them requiring a shift-out.
+//
+// - LED_MODULATION_BAM: bit angle modulation. The 4 bits of the pixels are
+// stored as 4 bitplanes, updated whenever a pixel is modified. A cycle takes
+// 15 refreshes, during which the n-th bitplane is shown for 2^n refreshes.
+// Write() only shifts out data at the first refresh of each bitplane - that is
+// to say 4 times per cycle - and ShiftOutPixels() only copies a bitplane. The
+// bitplanes are rebuilt from scratch at the beginning of the next cycle after
+// a call to pixels(), since writes through this pointer can't be tracked.
 
 #ifndef AVRLIB_DEVICES_LED_ARRAY_H_
 #define AVRLIB_DEVICES_LED_ARRAY_H_
@@ -28,13 +42,20 @@
 
 namespace avrlib {
 
-template<typename Latch, typename Clock, typename Data, uint8_t num_regs = 1, DataOrder order = LSB_FIRST>
+enum LedModulation {
+  LED_MODULATION_PWM,
+  LED_MODULATION_BAM
+};
+
+template<typename Latch, typename Clock, typename Data, uint8_t num_regs = 1, DataOrder order = LSB_FIRST, LedModulation modulation = LED_MODULATION_PWM, ShiftRegisterBackend backend = SHIFT_REGISTER_GPIO>
 class LedArray {
  public:
 
   enum {
     size = num_regs * 8,
     max_intensity = 0x0f,
+    num_bitplanes = modulation == LED_MODULATION_BAM ? 4 : 1,
+    num_slots = modulation == LED_MODULATION_BAM ? 15 : 16,
   };
 
   LedArray() { }
@@ -45,15 +66,18 @@ class LedArray {
   }
 
   static inline void set_pixel(uint8_t index) {
-    pixels_[index] = max_intensity;
+    set_pixel(index, max_intensity);
   }
 
   static inline void set_pixel(uint8_t index, uint8_t intensity) {
     pixels_[index] = intensity;
+    if (modulation == LED_MODULATION_BAM) {
+      UpdateBitplanes(index, intensity);
+    }
   }
 
   static inline void clr_pixel(uint8_t index) {
-    pixels_[index] = 0;
+    set_pixel(index, 0);
   }
 
   static inline uint8_t pixel(uint8_t index) {
@@ -73,14 +97,26 @@ class LedArray {
   }
   
   static inline void Clear() {
-    memset(pixels_, 0, size);
+    SetPixels(0);
   }
   
   static inline void SetPixels(uint8_t intensity) {
     memset(pixels_, intensity, size);
+    if (modulation == LED_MODULATION_BAM) {
+      for (uint8_t bit = 0; bit < num_bitplanes; ++bit) {
+        memset(
+            bitplanes_[bit],
+            (intensity & (1 << bit)) ? 0xff : 0x00,
+            num_regs);
+      }
+    }
   }
   
   static inline void ShiftOutPixels() {
+    if (modulation == LED_MODULATION_BAM) {
+      ShiftOutBitplane();
+      return;
+    }
     uint8_t threshold = refresh_cycle_ & max_intensity;
     
     uint8_t byte = 0;
@@ -107,27 +143,78 @@ class LedArray {
   }
   
   static inline void Write() {
+    // In BAM mode, the shift registers already hold the right bitplane,
+    // unless this is the first refresh slot of a bitplane.
+    if (modulation == LED_MODULATION_BAM &&
+        ((refresh_cycle_ + 1) & refresh_cycle_)) {
+      ++refresh_cycle_;
+      return;
+    }
     Begin();
     ShiftOutPixels();
     End();
   }
   
-  uint8_t* pixels() { return pixels_; }
+  static inline uint8_t* pixels() {
+    bitplanes_dirty_ = 1;
+    return pixels_;
+  }
   
  private:
-  typedef ShiftRegisterOutput<Latch, Clock, Data, 8, order> Register;
+  typedef ShiftRegisterOutput<Latch, Clock, Data, 8, order, backend> Register;
+  
+  static inline void UpdateBitplanes(uint8_t index, uint8_t intensity) {
+    uint8_t mask = 0x80 >> (index & 7);
+    uint8_t reg = index >> 3;
+    for (uint8_t bit = 0; bit < num_bitplanes; ++bit) {
+      if (intensity & 1) {
+        bitplanes_[bit][reg] |= mask;
+      } else {
+        bitplanes_[bit][reg] &= ~mask;
+      }
+      intensity >>= 1;
+    }
+  }
+  
+  static inline void ShiftOutBitplane() {
+    if (refresh_cycle_ >= num_slots) {
+      refresh_cycle_ = 0;
+    }
+    if (refresh_cycle_ == 0 && bitplanes_dirty_) {
+      bitplanes_dirty_ = 0;
+      for (uint8_t i = 0; i < size; ++i) {
+        UpdateBitplanes(i, pixels_[i]);
+      }
+    }
+    // Slot 0 shows bitplane 0, slots 1-2 bitplane 1, slots 3-6 bitplane 2,
+    // and slots 7-14 bitplane 3.
+    uint8_t bit = refresh_cycle_ >= 7 ? 3 : (refresh_cycle_ >= 3 ? 2 :
+        (refresh_cycle_ >= 1 ? 1 : 0));
+    for (uint8_t i = 0; i < num_regs; ++i) {
+      Register::ShiftOut(bitplanes_[bit][i]);
+    }
+    ++refresh_cycle_;
+  }
 
   static uint8_t pixels_[size];
+  static uint8_t bitplanes_[num_bitplanes][num_regs];
+  static uint8_t bitplanes_dirty_;
   static uint8_t refresh_cycle_;
 
   DISALLOW_COPY_AND_ASSIGN(LedArray);
 };
 
-template<typename Latch, typename Clock, typename Data, uint8_t num_regs, DataOrder order>
-uint8_t LedArray<Latch, Clock, Data, num_regs, order>::pixels_[size];
+template<typename Latch, typename Clock, typename Data, uint8_t num_regs, DataOrder order, LedModulation modulation, ShiftRegisterBackend backend>
+uint8_t LedArray<Latch, Clock, Data, num_regs, order, modulation, backend>::pixels_[size];
+
+template<typename Latch, typename Clock, typename Data, uint8_t num_regs, DataOrder order, LedModulation modulation, ShiftRegisterBackend backend>
+uint8_t LedArray<Latch, Clock, Data, num_regs, order, modulation, backend>::bitplanes_[num_bitplanes][num_regs];
+
+template<typename Latch, typename Clock, typename Data, uint8_t num_regs, DataOrder order, LedModulation modulation, ShiftRegisterBackend backend>
+uint8_t LedArray<Latch, Clock, Data, num_regs, order, modulation, backend>::bitplanes_dirty_;
 
-template<typename Latch, typename Clock, typename Data, uint8_t num_regs, DataOrder order>
-uint8_t LedArray<Latch, Clock, Data, num_regs, order>::refresh_cycle_;
+template<typename Latch, typename Clock, typename Data, uint8_t num_regs, DataOrder order, LedModulation modulation, ShiftRegisterBackend backend>
+uint8_t LedArray<Latch, Clock, Data, num_regs, order, modulation, backend>::refresh_cycle_;
 
 }  // namespace avrlib
 
@@ -55,6 +55,29 @@ class Dac {
 
   static inline void Write(uint8_t value, uint8_t channel) {
     value = U8Swap4(value);
+    Interface::WriteWord(Command(value, channel), value & 0xf0);
+  }
+
+  // Updates both channels of a dual DAC (MCP4922). The MCP492x latches one
+  // 16-bit command on each rising edge of CS, so CS is strobed between the two
+  // words: this saves one Begin/End pair, but these are still two
+  // transactions, and with LDAC tied low the second channel is updated about
+  // 16 SPI clocks after the first one.
+  static inline void WriteStereo(uint8_t a, uint8_t b) {
+    a = U8Swap4(a);
+    b = U8Swap4(b);
+    Interface::Begin();
+    Interface::Send(Command(a, 0));
+    Interface::Send(a & 0xf0);
+    Interface::Strobe();
+    Interface::Send(Command(b, 1));
+    Interface::Send(b & 0xf0);
+    Interface::End();
+  }
+
+ private:
+  // Expects a value with swapped nibbles.
+  static inline uint8_t Command(uint8_t value, uint8_t channel) {
     uint8_t command;
     command = (value & 0x0f) | 0x10;
     if (channel) {
@@ -66,7 +89,7 @@ class Dac {
     if (gain == 1) {
       command |= 0x20;
     }
-    Interface::WriteWord(command, value & 0xf0);
+    return command;
   }
 };
 
@@ -0,0 +1,207 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Scanner for an array of pots connected to the ADC through 4051 multiplexers.
+//
+// The address lines of all the 4051 are shared and driven by a Mux4051Port.
+// The output of the n-th 4051 is connected to the ADC input first_adc_pin + n.
+// Pot i is connected to input (i & 7) of the (i >> 3)-th 4051.
+//
+// The address lines are switched only once every num_muxes readings, at a time
+// selected by the timing parameter:
+// - MUX_SWITCH_BEFORE_CONVERSION: in Read(), right before starting the first
+//   conversion for the next address. The multiplexers have the delay between
+//   the start of the conversion and the sampling of the input to settle - 1.5
+//   ADC clock cycles, 12 us at 16 MHz. Read() never waits.
+// - MUX_SWITCH_AFTER_SAMPLE: while the last conversion for the current address
+//   is in progress, as soon as the ADC has sampled its input. The multiplexers
+//   have the whole interval between two calls to Read() to settle, but Read()
+//   busy-waits for the sampling delay (2.5 ADC clock cycles, including the
+//   wait for the ADC clock edge which starts the conversion; 20 us at 16 MHz)
+//   derived from F_CPU and the ADC prescaler set by Adc::Init().
+// In both cases, the settling time is not a parameter of its own: it is set by
+// the interval between two calls to Read().
+//
+// The readings are filtered with the same filters as PotScanner, and value(i),
+// changed(i), PullChange() and PushChanges() behave as in PotScanner.
+
+#ifndef AVRLIB_DEVICES_MUXED_POT_SCANNER_H_
+#define AVRLIB_DEVICES_MUXED_POT_SCANNER_H_
+
+#include <string.h>
+
+#include "avrlib/adc.h"
+#include "avrlib/devices/mux4051.h"
+#include "avrlib/devices/pot_scanner.h"
+#include "avrlib/log2.h"
+#include "avrlib/time.h"
+
+namespace avrlib {
+
+enum MuxSwitchTiming {
+  MUX_SWITCH_BEFORE_CONVERSION,
+  MUX_SWITCH_AFTER_SAMPLE
+};
+
+// Adc::Init() uses a prescaler of 128. The input is sampled 1.5 ADC clock
+// cycles after the start of the conversion, which itself waits for the next
+// rising edge of the ADC clock.
+const double kAdcSampleDelayUs = 2.5 * 128 * 1000000.0 / F_CPU;
+
+template<
+    typename Mux,
+    uint8_t num_muxes = 1,
+    uint8_t first_adc_pin = 0,
+    uint8_t oversampling = 8,
+    uint8_t resolution = 7,
+    uint8_t deadband = 0,
+    PotFilterType filter = POT_FILTER_BOXCAR,
+    MuxSwitchTiming timing = MUX_SWITCH_BEFORE_CONVERSION>
+class MuxedPotScanner {
+ public:
+  enum {
+    num_inputs = num_muxes * 8
+  };
+  typedef MuxedPotScanner<Mux, num_muxes, first_adc_pin, oversampling,
+                          resolution, deadband, filter, timing> Me;
+  typedef PotFilter<Me, filter, num_inputs, oversampling> Filter;
+
+  MuxedPotScanner() { }
+
+  static inline void Init() {
+    Adc::Init();
+    Adc::set_alignment(ADC_LEFT_ALIGNED);
+    Mux::Init();
+    Mux::Write(0);
+    Mux::Enable();
+    Filter::Init();
+    memset(reported_value_, 0, sizeof(reported_value_));
+    changed_.Clear();
+    address_ = 0;
+    mux_ = 0;
+    ConstantDelay(1);
+    // The first conversion after enabling the ADC samples its input 13.5 ADC
+    // clock cycles after its start, instead of 1.5. Get it out of the way.
+    Adc::StartConversion(first_adc_pin);
+    Adc::Wait();
+    StartConversion();
+  }
+
+  static inline void Read() {
+    uint8_t index = (mux_ << 3) | address_;
+    Adc::Wait();
+    Filter::Process(index, Adc::ReadOut8());
+
+    uint16_t v = value(index);
+    uint16_t delta = v > reported_value_[index]
+        ? v - reported_value_[index]
+        : reported_value_[index] - v;
+    if (delta > deadband) {
+      reported_value_[index] = v;
+      changed_.Set(index);
+    }
+
+    ++mux_;
+    if (mux_ == num_muxes) {
+      mux_ = 0;
+      address_ = (address_ + 1) & 7;
+      if (address_ == 0) {
+        Filter::EndOfScan();
+      }
+      if (timing == MUX_SWITCH_BEFORE_CONVERSION) {
+        Mux::Write(address_);
+      }
+    }
+    StartConversion();
+  }
+
+  static inline uint16_t value(uint8_t index) {
+    uint16_t shift = (Log2<oversampling>::value + 8 - resolution);
+    return Filter::value(index) >> shift;
+  }
+
+  static inline uint8_t last_read() {
+    uint8_t mux = mux_;
+    uint8_t address = address_;
+    if (mux == 0) {
+      mux = num_muxes;
+      address = (address - 1) & 7;
+    }
+    --mux;
+    return (mux << 3) | address;
+  }
+
+  static inline uint8_t changed(uint8_t index) {
+    return changed_.test(index);
+  }
+
+  static inline int8_t PullChange() {
+    return changed_.Pull();
+  }
+
+  template<typename Queue>
+  static void PushChanges(uint8_t first_id = 0) {
+    int8_t index;
+    while ((index = changed_.Pull()) != -1) {
+      Queue::AddEvent(CONTROL_POT, first_id + index, value(index));
+    }
+  }
+
+ private:
+  static inline void StartConversion() {
+    Adc::StartConversion(first_adc_pin + mux_);
+    if (timing == MUX_SWITCH_AFTER_SAMPLE && mux_ == num_muxes - 1) {
+      // This is the last pot read on this address. Once the ADC is done with
+      // sampling, start moving the multiplexers to the next address.
+      _delay_us(kAdcSampleDelayUs);
+      Mux::Write((address_ + 1) & 7);
+    }
+  }
+
+  static uint8_t address_;
+  static uint8_t mux_;
+  static uint16_t reported_value_[num_muxes * 8];
+  static PotChangeBitmap<num_muxes * 8> changed_;
+
+  DISALLOW_COPY_AND_ASSIGN(MuxedPotScanner);
+};
+
+/* static */
+template<typename Mux, uint8_t a, uint8_t b, uint8_t c, uint8_t d, uint8_t e,
+         PotFilterType f, MuxSwitchTiming g>
+uint8_t MuxedPotScanner<Mux, a, b, c, d, e, f, g>::address_;
+
+/* static */
+template<typename Mux, uint8_t a, uint8_t b, uint8_t c, uint8_t d, uint8_t e,
+         PotFilterType f, MuxSwitchTiming g>
+uint8_t MuxedPotScanner<Mux, a, b, c, d, e, f, g>::mux_;
+
+/* static */
+template<typename Mux, uint8_t num_muxes, uint8_t b, uint8_t c, uint8_t d,
+         uint8_t e, PotFilterType f, MuxSwitchTiming g>
+uint16_t MuxedPotScanner<Mux, num_muxes, b, c, d, e, f, g>::reported_value_[
+    num_muxes * 8];
+
+/* static */
+template<typename Mux, uint8_t num_muxes, uint8_t b, uint8_t c, uint8_t d,
+         uint8_t e, PotFilterType f, MuxSwitchTiming g>
+PotChangeBitmap<num_muxes * 8> MuxedPotScanner<Mux, num_muxes, b, c, d, e, f,
+                                               g>::changed_;
+
+}  // namespace avrlib
+
+#endif  // AVRLIB_DEVICES_MUXED_POT_SCANNER_H_
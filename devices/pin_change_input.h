@@ -0,0 +1,232 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Switches and encoders directly connected to pins with pin change interrupts.
+//
+// Instead of being polled, the inputs are read in the pin change interrupt
+// handler, and the resulting events are directly written to an EventQueue.
+// Pins are identified by their PCINT number (see the datasheet), and the
+// handler of each device sharing a pin change interrupt vector must be called
+// from the ISR:
+//
+// PIN_CHANGE_2 {
+//   Button::OnPinChange<Queue>(0);
+//   Encoder::OnPinChange<Queue>(1);
+// }
+//
+// Switches are debounced by ignoring, for debounce_time ms, the changes
+// following a reported change. A change ignored this way is only reported at
+// the next pin change - or by Poll(), which should be called periodically (for
+// example every few ms from the main loop or a timer ISR) so that a switch
+// settling during the lockout is not left in the wrong state:
+//
+// Button::Poll<Queue>(0);
+//
+// Encoders are decoded with a QuadratureDecoder, which is insensitive to
+// bounces.
+//
+// The events are added to the queue from the ISR, so other producers of the
+// same queue (in the main loop, or in other ISRs) must not be interrupted in
+// the middle of an addition: EventQueue::AddEvent() disables the interrupts
+// while it writes to the queue.
+
+#ifndef AVRLIB_DEVICES_PIN_CHANGE_INPUT_H_
+#define AVRLIB_DEVICES_PIN_CHANGE_INPUT_H_
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+
+#include "avrlib/base.h"
+#include "avrlib/devices/quadrature_decoder.h"
+#include "avrlib/gpio.h"
+#include "avrlib/time.h"
+#include "avrlib/ui/event_queue.h"
+
+namespace avrlib {
+
+template<uint8_t pcint>
+struct PinChangeInterrupt {
+  enum {
+    group = pcint >> 3,
+    mask = 1 << (pcint & 7)
+  };
+
+  static inline void Enable() {
+    switch (group) {
+      case 0:
+        PCMSK0 |= mask;
+        break;
+      case 1:
+        PCMSK1 |= mask;
+        break;
+      case 2:
+        PCMSK2 |= mask;
+        break;
+#ifdef PCMSK3
+      case 3:
+        PCMSK3 |= mask;
+        break;
+#endif  // PCMSK3
+    }
+    PCICR |= _BV(group);
+  }
+
+  static inline void Disable() {
+    switch (group) {
+      case 0:
+        PCMSK0 &= ~mask;
+        break;
+      case 1:
+        PCMSK1 &= ~mask;
+        break;
+      case 2:
+        PCMSK2 &= ~mask;
+        break;
+#ifdef PCMSK3
+      case 3:
+        PCMSK3 &= ~mask;
+        break;
+#endif  // PCMSK3
+    }
+  }
+};
+
+template<
+    typename Input,
+    uint8_t pcint,
+    uint8_t debounce_time = 5,
+    bool enable_pull_up = true>
+class PinChangeSwitch {
+ public:
+  PinChangeSwitch() { }
+
+  static inline void Init() {
+    Input::set_mode(DIGITAL_INPUT);
+    if (enable_pull_up) {
+      Input::High();
+    }
+    state_ = Input::value();
+    last_change_ = milliseconds();
+    PinChangeInterrupt<pcint>::Enable();
+  }
+
+  // Sends a CONTROL_SWITCH event with value 1 when the switch is pressed
+  // (input low), 0 when it is released.
+  template<typename Queue>
+  static inline void OnPinChange(uint8_t id) {
+    Update<Queue>(id);
+  }
+
+  // Reports a change which has been ignored because it happened during the
+  // lockout. Can be called from outside of the pin change ISR.
+  template<typename Queue>
+  static inline void Poll(uint8_t id) {
+    uint8_t old_sreg = SREG;
+    cli();
+    Update<Queue>(id);
+    SREG = old_sreg;
+  }
+
+  static inline uint8_t pressed() { return !state_; }
+  static inline uint8_t immediate_value() { return Input::value(); }
+
+ private:
+  template<typename Queue>
+  static inline void Update(uint8_t id) {
+    uint8_t value = Input::value();
+    if (value == state_) {
+      return;
+    }
+    uint16_t now = milliseconds();
+    if (static_cast<uint16_t>(now - last_change_) < debounce_time) {
+      return;
+    }
+    last_change_ = now;
+    state_ = value;
+    Queue::AddEvent(CONTROL_SWITCH, id, value ? 0 : 1);
+  }
+
+  static volatile uint8_t state_;
+  static volatile uint16_t last_change_;
+
+  DISALLOW_COPY_AND_ASSIGN(PinChangeSwitch);
+};
+
+/* static */
+template<typename Input, uint8_t pcint, uint8_t debounce_time,
+         bool enable_pull_up>
+volatile uint8_t PinChangeSwitch<Input, pcint, debounce_time,
+                                 enable_pull_up>::state_;
+
+/* static */
+template<typename Input, uint8_t pcint, uint8_t debounce_time,
+         bool enable_pull_up>
+volatile uint16_t PinChangeSwitch<Input, pcint, debounce_time,
+                                  enable_pull_up>::last_change_;
+
+template<
+    typename A,
+    typename B,
+    uint8_t pcint_a,
+    uint8_t pcint_b,
+    QuadratureDecoding decoding = QUADRATURE_FULL_STEP>
+class PinChangeEncoder {
+ public:
+  PinChangeEncoder() { }
+
+  static inline void Init() {
+    A::set_mode(DIGITAL_INPUT);
+    B::set_mode(DIGITAL_INPUT);
+    A::High();
+    B::High();
+    decoder_.Init();
+    decoder_.Process(A::value(), B::value());
+    PinChangeInterrupt<pcint_a>::Enable();
+    PinChangeInterrupt<pcint_b>::Enable();
+  }
+
+  // Sends a CONTROL_ENCODER event with value +1 or -1 for each step.
+  template<typename Queue>
+  static inline void OnPinChange(uint8_t id) {
+    int8_t increment = decoder_.Process(A::value(), B::value());
+    if (increment) {
+      Queue::AddEvent(CONTROL_ENCODER, id, increment);
+    }
+  }
+
+ private:
+  static QuadratureDecoder<decoding> decoder_;
+
+  DISALLOW_COPY_AND_ASSIGN(PinChangeEncoder);
+};
+
+/* static */
+template<typename A, typename B, uint8_t pcint_a, uint8_t pcint_b,
+         QuadratureDecoding decoding>
+QuadratureDecoder<decoding> PinChangeEncoder<A, B, pcint_a, pcint_b,
+                                             decoding>::decoder_;
+
+#define PIN_CHANGE_0 ISR(PCINT0_vect)
+#define PIN_CHANGE_1 ISR(PCINT1_vect)
+#define PIN_CHANGE_2 ISR(PCINT2_vect)
+#ifdef PCINT3_vect
+#define PIN_CHANGE_3 ISR(PCINT3_vect)
+#endif  // PCINT3_vect
+
+}  // namespace avrlib
+
+#endif  // AVRLIB_DEVICES_PIN_CHANGE_INPUT_H_
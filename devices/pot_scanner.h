@@ -19,22 +19,302 @@
 // to the ADC:
 // - PotScanner uses averaging.
 // - HysteresisPotScanner uses a deadband around the latest stable reading.
+//
+// The averaging filter used by PotScanner is selected at compile time:
+// - POT_FILTER_BOXCAR: moving average over the last oversampling readings.
+//   oversampling bytes + 2 bytes per pot.
+// - POT_FILTER_ONE_POLE: leaky integrator, with a time constant of oversampling
+//   readings. 2 bytes per pot.
+// - POT_FILTER_CIC: first order CIC decimator (integrate and dump). The value
+//   is updated once every oversampling readings. 4 bytes per pot.
+// - POT_FILTER_MEDIAN_3: median of the last 3 readings. Rejects isolated
+//   spikes but does not smooth noise. 3 bytes per pot.
+//
+// Both scanners keep track of which pots have moved since they were last
+// reported, so that the UI code only has to process the pots that actually
+// changed:
+//
+// int8_t pot;
+// while ((pot = Pots::PullChange()) != -1) {
+//   HandlePot(pot, Pots::value(pot));
+// }
+//
+// or, to feed an event queue directly:
+//
+// Pots::PushChanges<EventQueue<32> >();
 
 #ifndef AVRLIB_DEVICES_POT_SCANNER_H_
 #define AVRLIB_DEVICES_POT_SCANNER_H_
 
+#include <avr/interrupt.h>
+#include <string.h>
+
 #include "avrlib/adc.h"
 #include "avrlib/log2.h"
+#include "avrlib/ui/event_queue.h"
 
 namespace avrlib {
 
+// One bit per pot, set by the scanner when a pot has moved, and cleared when
+// the change is pulled by the UI.
+template<uint8_t num_inputs>
+struct PotChangeBitmap {
+  enum {
+    num_bytes = (num_inputs + 7) >> 3
+  };
+
+  inline void Clear() {
+    for (uint8_t i = 0; i < num_bytes; ++i) {
+      bits[i] = 0;
+    }
+  }
+
+  inline void Set(uint8_t index) {
+    bits[index >> 3] |= _BV(index & 7);
+  }
+
+  inline uint8_t test(uint8_t index) const {
+    return bits[index >> 3] & _BV(index & 7);
+  }
+
+  // Returns the index of the first pot flagged as changed, and clears its flag.
+  // Returns -1 if no pot has changed. Bytes with no changes are skipped in one
+  // comparison, so this is cheap when the panel is idle.
+  int8_t Pull() {
+    // The index must fit in an int8_t.
+    STATIC_ASSERT(num_inputs <= 128);
+    for (uint8_t i = 0; i < num_bytes; ++i) {
+      uint8_t byte = bits[i];
+      if (byte) {
+        uint8_t index = i << 3;
+        uint8_t mask = 1;
+        while (!(byte & mask)) {
+          mask <<= 1;
+          ++index;
+        }
+        // The scanner might be running from an interrupt and flag another pot
+        // in the same byte.
+        uint8_t old_sreg = SREG;
+        cli();
+        bits[i] &= ~mask;
+        SREG = old_sreg;
+        return index;
+      }
+    }
+    return -1;
+  }
+
+  volatile uint8_t bits[num_bytes];
+};
+
+enum PotFilterType {
+  POT_FILTER_BOXCAR,
+  POT_FILTER_ONE_POLE,
+  POT_FILTER_CIC,
+  POT_FILTER_MEDIAN_3
+};
+
+// All filters take 8-bit readings and output values scaled by oversampling,
+// that is to say on 8 + log2(oversampling) bits. Owner is only used to
+// allocate distinct state variables for each scanner. state_size is the RAM
+// used by the filter, in bytes.
+template<typename Owner, PotFilterType type, uint8_t num_inputs,
+         uint8_t oversampling>
+struct PotFilter { };
+
+template<typename Owner, uint8_t num_inputs, uint8_t oversampling>
+struct PotFilter<Owner, POT_FILTER_BOXCAR, num_inputs, oversampling> {
+  enum {
+    state_size = num_inputs * (oversampling + 2) + 1
+  };
+
+  static inline void Init() {
+    history_ptr_ = 0;
+    memset(history_, 0, sizeof(history_));
+    memset(sum_, 0, sizeof(sum_));
+  }
+  
+  static inline void Process(uint8_t channel, uint8_t sample) {
+    uint8_t index = history_ptr_ + oversampling * channel;
+    sum_[channel] -= history_[index];
+    history_[index] = sample;
+    sum_[channel] += sample;
+  }
+  
+  static inline void EndOfScan() {
+    ++history_ptr_;
+    if (history_ptr_ == oversampling) {
+      history_ptr_ = 0;
+    }
+  }
+  
+  static inline uint16_t value(uint8_t channel) {
+    return sum_[channel];
+  }
+
+ private:
+  static uint8_t history_[num_inputs * oversampling];
+  static uint16_t sum_[num_inputs];
+  static uint8_t history_ptr_;
+};
+
+/* static */
+template<typename Owner, uint8_t num_inputs, uint8_t oversampling>
+uint8_t PotFilter<Owner, POT_FILTER_BOXCAR, num_inputs,
+                  oversampling>::history_[num_inputs * oversampling];
+
+/* static */
+template<typename Owner, uint8_t num_inputs, uint8_t oversampling>
+uint16_t PotFilter<Owner, POT_FILTER_BOXCAR, num_inputs,
+                   oversampling>::sum_[num_inputs];
+
+/* static */
+template<typename Owner, uint8_t num_inputs, uint8_t oversampling>
+uint8_t PotFilter<Owner, POT_FILTER_BOXCAR, num_inputs,
+                  oversampling>::history_ptr_;
+
+template<typename Owner, uint8_t num_inputs, uint8_t oversampling>
+struct PotFilter<Owner, POT_FILTER_ONE_POLE, num_inputs, oversampling> {
+  enum {
+    state_size = num_inputs * 2
+  };
+
+  static inline void Init() {
+    memset(state_, 0, sizeof(state_));
+  }
+  
+  // state += sample - state / oversampling. In the steady state, state is
+  // equal to sample * oversampling.
+  static inline void Process(uint8_t channel, uint8_t sample) {
+    uint16_t state = state_[channel];
+    state_[channel] = state + sample - (state >> Log2<oversampling>::value);
+  }
+  
+  static inline void EndOfScan() { }
+  
+  static inline uint16_t value(uint8_t channel) {
+    return state_[channel];
+  }
+
+ private:
+  static uint16_t state_[num_inputs];
+};
+
+/* static */
+template<typename Owner, uint8_t num_inputs, uint8_t oversampling>
+uint16_t PotFilter<Owner, POT_FILTER_ONE_POLE, num_inputs,
+                   oversampling>::state_[num_inputs];
+
+template<typename Owner, uint8_t num_inputs, uint8_t oversampling>
+struct PotFilter<Owner, POT_FILTER_CIC, num_inputs, oversampling> {
+  enum {
+    state_size = num_inputs * 4 + 1
+  };
+
+  static inline void Init() {
+    phase_ = 0;
+    memset(accumulator_, 0, sizeof(accumulator_));
+    memset(output_, 0, sizeof(output_));
+  }
+  
+  // The output of each channel is dumped when its last reading of the
+  // decimation period comes in, rather than for all channels at the end of
+  // the scan, so that the cost of the dump is spread over all calls.
+  static inline void Process(uint8_t channel, uint8_t sample) {
+    uint16_t sum = accumulator_[channel] + sample;
+    if (phase_ == oversampling - 1) {
+      output_[channel] = sum;
+      sum = 0;
+    }
+    accumulator_[channel] = sum;
+  }
+  
+  static inline void EndOfScan() {
+    ++phase_;
+    if (phase_ == oversampling) {
+      phase_ = 0;
+    }
+  }
+  
+  static inline uint16_t value(uint8_t channel) {
+    return output_[channel];
+  }
+
+ private:
+  static uint16_t accumulator_[num_inputs];
+  static uint16_t output_[num_inputs];
+  static uint8_t phase_;
+};
+
+/* static */
+template<typename Owner, uint8_t num_inputs, uint8_t oversampling>
+uint16_t PotFilter<Owner, POT_FILTER_CIC, num_inputs,
+                   oversampling>::accumulator_[num_inputs];
+
+/* static */
+template<typename Owner, uint8_t num_inputs, uint8_t oversampling>
+uint16_t PotFilter<Owner, POT_FILTER_CIC, num_inputs,
+                   oversampling>::output_[num_inputs];
+
+/* static */
+template<typename Owner, uint8_t num_inputs, uint8_t oversampling>
+uint8_t PotFilter<Owner, POT_FILTER_CIC, num_inputs, oversampling>::phase_;
+
+template<typename Owner, uint8_t num_inputs, uint8_t oversampling>
+struct PotFilter<Owner, POT_FILTER_MEDIAN_3, num_inputs, oversampling> {
+  enum {
+    state_size = num_inputs * 3
+  };
+
+  static inline void Init() {
+    memset(history_, 0, sizeof(history_));
+    memset(median_, 0, sizeof(median_));
+  }
+  
+  static inline void Process(uint8_t channel, uint8_t sample) {
+    uint8_t a = history_[channel][0];
+    uint8_t b = history_[channel][1];
+    uint8_t low = a < b ? a : b;
+    uint8_t high = a < b ? b : a;
+    median_[channel] = sample < low ? low : (sample > high ? high : sample);
+    history_[channel][0] = b;
+    history_[channel][1] = sample;
+  }
+  
+  static inline void EndOfScan() { }
+  
+  static inline uint16_t value(uint8_t channel) {
+    return static_cast<uint16_t>(median_[channel]) << Log2<oversampling>::value;
+  }
+
+ private:
+  static uint8_t history_[num_inputs][2];
+  static uint8_t median_[num_inputs];
+};
+
+/* static */
+template<typename Owner, uint8_t num_inputs, uint8_t oversampling>
+uint8_t PotFilter<Owner, POT_FILTER_MEDIAN_3, num_inputs,
+                  oversampling>::history_[num_inputs][2];
+
+/* static */
+template<typename Owner, uint8_t num_inputs, uint8_t oversampling>
+uint8_t PotFilter<Owner, POT_FILTER_MEDIAN_3, num_inputs,
+                  oversampling>::median_[num_inputs];
+
 template<
     uint8_t num_inputs,
     uint8_t first_input_index = 0,
     uint8_t oversampling = 8,
-    uint8_t resolution = 7>
+    uint8_t resolution = 7,
+    uint8_t deadband = 0,
+    PotFilterType filter = POT_FILTER_BOXCAR>
 class PotScanner {
  public:
+  typedef PotScanner<num_inputs, first_input_index, oversampling, resolution,
+                     deadband, filter> Me;
+  typedef PotFilter<Me, filter, num_inputs, oversampling> Filter;
+
   PotScanner() { }
 
   static inline void Init() {
@@ -42,25 +322,30 @@ class PotScanner {
     Adc::set_alignment(ADC_LEFT_ALIGNED);
     scan_cycle_ = 0;
     Adc::StartConversion(scan_cycle_ + first_input_index);
-    history_ptr_ = 0;
-    memset(history_, 0, sizeof(history_));
-    memset(value_, 0, sizeof(value_));
+    Filter::Init();
+    memset(reported_value_, 0, sizeof(reported_value_));
+    changed_.Clear();
   }
   
   static inline void Read() {
-    uint8_t index = history_ptr_ + oversampling * scan_cycle_;
-    value_[scan_cycle_] -= history_[index];
     Adc::Wait();
-    history_[index] = Adc::ReadOut8();
-    value_[scan_cycle_] += history_[index];
+    Filter::Process(scan_cycle_, Adc::ReadOut8());
+    
+    // Flag the pot as changed when its value has moved by more than deadband
+    // steps (at the output resolution) since it was last flagged.
+    uint16_t v = value(scan_cycle_);
+    uint16_t delta = v > reported_value_[scan_cycle_]
+        ? v - reported_value_[scan_cycle_]
+        : reported_value_[scan_cycle_] - v;
+    if (delta > deadband) {
+      reported_value_[scan_cycle_] = v;
+      changed_.Set(scan_cycle_);
+    }
     
     ++scan_cycle_;
     if (scan_cycle_ == num_inputs) {
       scan_cycle_ = 0;
-      ++history_ptr_;
-      if (history_ptr_ == oversampling) {
-        history_ptr_ = 0;
-      }
+      Filter::EndOfScan();
     }
     
     Adc::StartConversion(scan_cycle_ + first_input_index);
@@ -68,7 +353,7 @@ class PotScanner {
   
   static inline uint16_t value(uint8_t index) {
     uint16_t shift = (Log2<oversampling>::value + 8 - resolution);
-    return value_[index] >> shift;
+    return Filter::value(index) >> shift;
   }
   
   static inline uint8_t last_read() {
@@ -78,32 +363,47 @@ class PotScanner {
       return (scan_cycle_ - 1);
     }
   }
+  
+  static inline uint8_t changed(uint8_t index) {
+    return changed_.test(index);
+  }
+  
+  static inline int8_t PullChange() {
+    return changed_.Pull();
+  }
+  
+  // Adds a CONTROL_POT event for each pot that has moved, with ids starting
+  // at first_id.
+  template<typename Queue>
+  static void PushChanges(uint8_t first_id = 0) {
+    int8_t index;
+    while ((index = changed_.Pull()) != -1) {
+      Queue::AddEvent(CONTROL_POT, first_id + index, value(index));
+    }
+  }
 
  private:
   static uint8_t scan_cycle_;
-  static uint8_t history_[num_inputs * oversampling];
-  static uint16_t value_[num_inputs];
-  static uint8_t history_ptr_;
+  static uint16_t reported_value_[num_inputs];
+  static PotChangeBitmap<num_inputs> changed_;
 
   DISALLOW_COPY_AND_ASSIGN(PotScanner);
 };
 
 /* static */
-template<uint8_t a, uint8_t b, uint8_t c, uint8_t d>
-uint8_t PotScanner<a, b, c, d>::scan_cycle_;
-
-/* static */
-template<uint8_t a, uint8_t b, uint8_t c, uint8_t d>
-uint8_t PotScanner<a, b, c, d>::history_ptr_;
+template<uint8_t a, uint8_t b, uint8_t c, uint8_t d, uint8_t e,
+         PotFilterType f>
+uint8_t PotScanner<a, b, c, d, e, f>::scan_cycle_;
 
 /* static */
-template<uint8_t num_inputs, uint8_t b, uint8_t c, uint8_t d>
-uint16_t PotScanner<num_inputs, b, c, d>::value_[num_inputs];
+template<uint8_t num_inputs, uint8_t b, uint8_t c, uint8_t d, uint8_t e,
+         PotFilterType f>
+uint16_t PotScanner<num_inputs, b, c, d, e, f>::reported_value_[num_inputs];
 
 /* static */
-template<uint8_t num_inputs, uint8_t b, uint8_t oversampling, uint8_t d>
-uint8_t PotScanner<num_inputs, b, oversampling, d>::history_[
-    num_inputs * oversampling];
+template<uint8_t num_inputs, uint8_t b, uint8_t c, uint8_t d, uint8_t e,
+         PotFilterType f>
+PotChangeBitmap<num_inputs> PotScanner<num_inputs, b, c, d, e, f>::changed_;
 
 
 template<
@@ -120,6 +420,7 @@ class HysteresisPotScanner {
     scan_cycle_ = 0;
     Adc::StartConversion(scan_cycle_ + first_input_index);
     Lock(threshold);
+    changed_.Clear();
   }
   
   static void Lock(uint16_t locked_threshold) {
@@ -139,6 +440,7 @@ class HysteresisPotScanner {
     if (delta >= thresholds_[scan_cycle_]) {
       thresholds_[scan_cycle_] = threshold;
       value_[scan_cycle_] = value;
+      changed_.Set(scan_cycle_);
     }
     ++scan_cycle_;
     if (scan_cycle_ == num_inputs) {
@@ -159,11 +461,33 @@ class HysteresisPotScanner {
       return (scan_cycle_ - 1);
     }
   }
+  
+  // The deadband is the hysteresis threshold: a pot is flagged as changed
+  // whenever its stable reading is updated.
+  static inline uint8_t changed(uint8_t index) {
+    return changed_.test(index);
+  }
+  
+  static inline int8_t PullChange() {
+    return changed_.Pull();
+  }
+  
+  // Adds a CONTROL_POT event for each pot that has moved, with ids starting
+  // at first_id. Only the 8 LSBs of the value fit in an event, so this is
+  // meant to be used with resolution <= 8.
+  template<typename Queue>
+  static void PushChanges(uint8_t first_id = 0) {
+    int8_t index;
+    while ((index = changed_.Pull()) != -1) {
+      Queue::AddEvent(CONTROL_POT, first_id + index, value(index));
+    }
+  }
 
  private:
   static uint8_t scan_cycle_;
   static uint16_t value_[num_inputs];
   static uint16_t thresholds_[num_inputs];
+  static PotChangeBitmap<num_inputs> changed_;
 
   DISALLOW_COPY_AND_ASSIGN(HysteresisPotScanner);
 };
@@ -181,6 +505,10 @@ uint16_t HysteresisPotScanner<num_inputs, b, c, d>::value_[num_inputs];
 template<uint8_t num_inputs, uint8_t b, uint8_t c, uint8_t d>
 uint16_t HysteresisPotScanner<num_inputs, b, c, d>::thresholds_[num_inputs];
 
+/* static */
+template<uint8_t num_inputs, uint8_t b, uint8_t c, uint8_t d>
+PotChangeBitmap<num_inputs> HysteresisPotScanner<num_inputs, b, c, d>::changed_;
+
 
 }  // namespace avrlib
 
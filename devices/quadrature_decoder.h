@@ -0,0 +1,98 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// State machine decoder for the Gray code produced by quadrature encoders.
+//
+// The previous and current values of the A/B lines index a 16 entries table
+// giving the direction of the transition (+1/-1), or 0 when nothing happened
+// or when the transition is invalid (both lines have changed since the last
+// reading). Contact bounces thus cancel out, and the decoder only needs to
+// see each transition once - while the history-based decoding needs 8
+// consecutive stable readings.
+//
+// The quarter steps are then counted, and reported:
+// - QUADRATURE_QUARTER_STEP: at each transition.
+// - QUADRATURE_HALF_STEP: when both lines are at the same level.
+// - QUADRATURE_FULL_STEP: when both lines are high (detent position).
+//
+// QUADRATURE_HISTORY selects, in the encoder drivers, the legacy decoding.
+
+#ifndef AVRLIB_DEVICES_QUADRATURE_DECODER_H_
+#define AVRLIB_DEVICES_QUADRATURE_DECODER_H_
+
+#include <avr/pgmspace.h>
+
+#include "avrlib/base.h"
+
+namespace avrlib {
+
+enum QuadratureDecoding {
+  QUADRATURE_HISTORY,
+  QUADRATURE_FULL_STEP,
+  QUADRATURE_HALF_STEP,
+  QUADRATURE_QUARTER_STEP
+};
+
+template<QuadratureDecoding decoding>
+struct QuadratureDecoder {
+  inline void Init() {
+    previous = 3;
+    count = 0;
+  }
+
+  // a and b are the current levels (0 or 1) of the A and B lines.
+  inline int8_t Process(uint8_t a, uint8_t b) {
+    uint8_t current = (a << 1) | b;
+    int8_t step = pgm_read_byte(transitions + ((previous << 2) | current));
+    previous = current;
+    if (decoding == QUADRATURE_QUARTER_STEP) {
+      return step;
+    }
+    count += step;
+    int8_t increment = 0;
+    if (current == 3 || (decoding == QUADRATURE_HALF_STEP && current == 0)) {
+      // A detent has been reached. At least half of the steps leading to it
+      // must have been seen.
+      if (count >= 2) {
+        increment = 1;
+      } else if (count <= -2) {
+        increment = -1;
+      }
+      count = 0;
+    }
+    return increment;
+  }
+
+  uint8_t previous;
+  int8_t count;
+
+  // Indexed by (previous A << 3) | (previous B << 2) | (A << 1) | B.
+  static const int8_t transitions[16];
+};
+
+/* static */
+template<QuadratureDecoding decoding>
+const int8_t QuadratureDecoder<decoding>::transitions[16] PROGMEM = {
+  0, 1, -1, 0,
+  -1, 0, 0, 1,
+  1, 0, 0, -1,
+  0, -1, 1, 0
+};
+
+}  // namespace avrlib
+
+#endif  // AVRLIB_DEVICES_QUADRATURE_DECODER_H_
@@ -16,17 +16,29 @@
 // -----------------------------------------------------------------------------
 //
 // Driver for an external rotary encoder.
+//
+// EncoderAccelerator turns the -1/0/+1 increments read from one or several
+// encoders into larger increments when the encoders are turned fast, and
+// accumulates them until they are pulled by the UI code.
 
 #ifndef AVRLIB_DEVICES_ROTARY_ENCODER_H_
 #define AVRLIB_DEVICES_ROTARY_ENCODER_H_
 
+#include <avr/interrupt.h>
+
+#include "avrlib/devices/quadrature_decoder.h"
 #include "avrlib/devices/switch.h"
 #include "avrlib/gpio.h"
 #include "avrlib/time.h"
+#include "avrlib/ui/event_queue.h"
 
 namespace avrlib {
 
-template<typename A, typename B, typename Click>
+template<
+    typename A,
+    typename B,
+    typename Click,
+    QuadratureDecoding decoding = QUADRATURE_HISTORY>
 class RotaryEncoder {
  public:
   typedef DebouncedSwitch<A> SwitchA;
@@ -39,6 +51,7 @@ class RotaryEncoder {
     SwitchA::Init();
     SwitchB::Init();
     SwitchClick::Init();
+    decoder_.Init();
   }
 
   static inline int8_t Read() {
@@ -50,6 +63,9 @@ class RotaryEncoder {
     int8_t increment = 0;
     uint8_t a = SwitchA::Read();
     uint8_t b = SwitchB::Read();
+    if (decoding != QUADRATURE_HISTORY) {
+      return decoder_.Process(a & 1, b & 1);
+    }
     if (a == 0x80 && ((b & 0xf0) == 0x00)) {
         increment = 1;
     } else {
@@ -68,9 +84,15 @@ class RotaryEncoder {
   static uint8_t immediate_value() { return SwitchClick::immediate_value(); }
 
  private:
+  static QuadratureDecoder<decoding> decoder_;
+
   DISALLOW_COPY_AND_ASSIGN(RotaryEncoder);
 };
 
+/* static */
+template<typename A, typename B, typename Click, QuadratureDecoding decoding>
+QuadratureDecoder<decoding> RotaryEncoder<A, B, Click, decoding>::decoder_;
+
 template<typename Encoder>
 class RotaryEncoderTracker {
  public:
@@ -110,6 +132,123 @@ template<typename Encoder> uint8_t RotaryEncoderTracker<Encoder>::clicked_;
 /* static */
 template<typename Encoder> int8_t RotaryEncoderTracker<Encoder>::increment_;
 
+// Acceleration curve: gives the size of an increment given the time elapsed
+// (in ms) since the previous detent in the same direction. A custom curve can
+// be any class with a static multiplier(uint16_t interval) method.
+template<
+    uint8_t interval_2x = 60,
+    uint8_t interval_4x = 30,
+    uint8_t interval_8x = 15,
+    uint8_t interval_16x = 8>
+struct EncoderAccelerationCurve {
+  static inline uint8_t multiplier(uint16_t interval) {
+    if (interval >= interval_2x) {
+      return 1;
+    } else if (interval >= interval_4x) {
+      return 2;
+    } else if (interval >= interval_8x) {
+      return 4;
+    } else if (interval >= interval_16x) {
+      return 8;
+    } else {
+      return 16;
+    }
+  }
+};
+
+template<
+    uint8_t num_encoders = 1,
+    typename Curve = EncoderAccelerationCurve<> >
+class EncoderAccelerator {
+ public:
+  EncoderAccelerator() { }
+
+  static void Init() {
+    for (uint8_t i = 0; i < num_encoders; ++i) {
+      last_time_[i] = 0;
+      last_direction_[i] = 0;
+      accumulated_[i] = 0;
+    }
+  }
+
+  // To call from the encoder polling code, with the increment read from the
+  // encoder.
+  static inline void Process(uint8_t index, int8_t increment) {
+    if (!increment) {
+      return;
+    }
+    uint16_t now = milliseconds();
+    uint8_t multiplier = 1;
+    if (increment == last_direction_[index]) {
+      multiplier = Curve::multiplier(now - last_time_[index]);
+    }
+    last_time_[index] = now;
+    last_direction_[index] = increment;
+    if (increment > 0) {
+      accumulated_[index] += multiplier;
+    } else {
+      accumulated_[index] -= multiplier;
+    }
+  }
+
+  // Returns the sum of the increments received since the last call.
+  static int16_t PullIncrement(uint8_t index) {
+    uint8_t old_sreg = SREG;
+    cli();
+    int16_t increment = accumulated_[index];
+    accumulated_[index] = 0;
+    SREG = old_sreg;
+    return increment;
+  }
+
+  // Sends one CONTROL_ENCODER event per encoder which has moved. Increments
+  // not fitting in an event are kept for the next call.
+  template<typename Queue>
+  static void PushEvents(uint8_t first_id = 0) {
+    for (uint8_t i = 0; i < num_encoders; ++i) {
+      if (!accumulated_[i]) {
+        continue;
+      }
+      int16_t increment = PullIncrement(i);
+      int16_t remainder = 0;
+      if (increment > 127) {
+        remainder = increment - 127;
+        increment = 127;
+      } else if (increment < -127) {
+        remainder = increment + 127;
+        increment = -127;
+      }
+      if (remainder) {
+        uint8_t old_sreg = SREG;
+        cli();
+        accumulated_[i] += remainder;
+        SREG = old_sreg;
+      }
+      Queue::AddEvent(CONTROL_ENCODER, first_id + i, increment);
+    }
+  }
+
+ private:
+  static uint16_t last_time_[num_encoders];
+  static int8_t last_direction_[num_encoders];
+  static volatile int16_t accumulated_[num_encoders];
+
+  DISALLOW_COPY_AND_ASSIGN(EncoderAccelerator);
+};
+
+/* static */
+template<uint8_t num_encoders, typename Curve>
+uint16_t EncoderAccelerator<num_encoders, Curve>::last_time_[num_encoders];
+
+/* static */
+template<uint8_t num_encoders, typename Curve>
+int8_t EncoderAccelerator<num_encoders, Curve>::last_direction_[num_encoders];
+
+/* static */
+template<uint8_t num_encoders, typename Curve>
+volatile int16_t EncoderAccelerator<num_encoders, Curve>::accumulated_[
+    num_encoders];
+
 }  // namespace avrlib
 
 #endif  // AVRLIB_DEVICES_SHIFT_REGISTER_H_
@@ -18,12 +18,25 @@
 // -----------------------------------------------------------------------------
 //
 // Driver for an array of clickable rotary encoders.
+//
+// In DEBOUNCE_VERTICAL_COUNTER mode, the A, B and click lines are debounced
+// 8 encoders at a time (see devices/switch.h). An increment is reported when
+// A goes low while B is low, a decrement when B goes low while A is low.
+// clicked_mask(group), lowered_mask(group) and raised_mask(group) return the
+// click events of encoders 8 * group to 8 * group + 7 in a single byte.
+//
+// With a decoding other than QUADRATURE_HISTORY, the A/B levels of each
+// encoder are decoded by a QuadratureDecoder at each call to Poll(), and the
+// increments accumulated until they are collected by Read(index) - which must
+// be called from the same context as Poll().
 
 #ifndef AVRLIB_DEVICES_ROTARY_ENCODER_ARRAY_H_
 #define AVRLIB_DEVICES_ROTARY_ENCODER_ARRAY_H_
 
 #include <string.h>
 
+#include "avrlib/devices/quadrature_decoder.h"
+#include "avrlib/devices/switch.h"
 #include "avrlib/gpio.h"
 #include "avrlib/time.h"
 
@@ -35,9 +48,15 @@ template<
     typename A,
     typename B,
     typename C,
-    uint8_t size = 8>
+    uint8_t size = 8,
+    DebounceMode debounce = DEBOUNCE_HISTORY,
+    QuadratureDecoding decoding = QUADRATURE_HISTORY>
 class RotaryEncoderArray {
  public:
+  enum {
+    num_groups = (size + 7) >> 3
+  };
+
   RotaryEncoderArray() { }
   ~RotaryEncoderArray() { }
 
@@ -50,9 +69,21 @@ class RotaryEncoderArray {
     Load::High();
     Clock::Low();
 
-    memset(stateA_, 0xff, sizeof(stateA_));
-    memset(stateB_, 0xff, sizeof(stateB_));
-    memset(stateC_, 0xff, sizeof(stateC_));
+    if (debounce == DEBOUNCE_VERTICAL_COUNTER) {
+      a_.Init();
+      b_.Init();
+      c_.Init();
+    } else {
+      memset(stateA_, 0xff, sizeof(stateA_));
+      memset(stateB_, 0xff, sizeof(stateB_));
+      memset(stateC_, 0xff, sizeof(stateC_));
+    }
+    if (decoding != QUADRATURE_HISTORY) {
+      for (uint8_t i = 0; i < size; ++i) {
+        decoder_[i].Init();
+        increment_[i] = 0;
+      }
+    }
   }
 
   // To catch all clicks this has to be called at rate 5KHz or higher. 
@@ -61,6 +92,28 @@ class RotaryEncoderArray {
     Load::Low();
     Load::High();
 
+    if (debounce == DEBOUNCE_VERTICAL_COUNTER) {
+      // When size is not a multiple of 8, the unused bits of the last group
+      // are padded with 1s, so that they are never seen as pressed.
+      uint8_t a = 0xff;
+      uint8_t b = 0xff;
+      uint8_t c = 0xff;
+      for (uint8_t i = size; i--; ) {
+        a = (a << 1) | A::value();
+        b = (b << 1) | B::value();
+        c = (c << 1) | C::value();
+        Clock::High();
+        Clock::Low();
+        if (!(i & 7)) {
+          a_.Process(i >> 3, a);
+          b_.Process(i >> 3, b);
+          c_.Process(i >> 3, c);
+        }
+      }
+      Decode();
+      return;
+    }
+
     for (uint8_t i = size; i--; ) {
       stateA_[i] = (stateA_[i] << 1) | A::value();
       stateB_[i] = (stateB_[i] << 1) | B::value();
@@ -68,10 +121,26 @@ class RotaryEncoderArray {
       Clock::High();
       Clock::Low();
     }
+    Decode();
   }
 
   // This executes in 200ns at 20MHz
   static inline int8_t Read(uint8_t index) {
+    if (decoding != QUADRATURE_HISTORY) {
+      int8_t increment = increment_[index];
+      increment_[index] = 0;
+      return increment;
+    }
+    if (debounce == DEBOUNCE_VERTICAL_COUNTER) {
+      uint8_t group = index >> 3;
+      uint8_t mask = 1 << (index & 7);
+      if (a_.lowered[group] & ~b_.state[group] & mask) {
+        return 1;
+      } else if (b_.lowered[group] & ~a_.state[group] & mask) {
+        return -1;
+      }
+      return 0;
+    }
     int8_t increment = 0;
     uint8_t a = stateA_[index];
     uint8_t b = stateB_[index];
@@ -87,11 +156,42 @@ class RotaryEncoderArray {
 
   static uint8_t clicked(uint8_t index) { return raised(index); }
 
-  static inline uint8_t lowered(uint8_t index) { return stateC_[index] == 0x80; }
-  static inline uint8_t raised(uint8_t index) { return stateC_[index] == 0x7f; }
-  static inline uint8_t high(uint8_t index) { return stateC_[index] == 0xff; }
-  static inline uint8_t low(uint8_t index) { return stateC_[index] == 0x00; }
-  static inline uint8_t state(uint8_t index) { return stateC_[index]; }
+  static inline uint8_t lowered(uint8_t index) {
+    if (debounce == DEBOUNCE_VERTICAL_COUNTER) {
+      return c_.lowered[index >> 3] & (1 << (index & 7));
+    }
+    return stateC_[index] == 0x80;
+  }
+  static inline uint8_t raised(uint8_t index) {
+    if (debounce == DEBOUNCE_VERTICAL_COUNTER) {
+      return c_.raised[index >> 3] & (1 << (index & 7));
+    }
+    return stateC_[index] == 0x7f;
+  }
+  static inline uint8_t high(uint8_t index) {
+    if (debounce == DEBOUNCE_VERTICAL_COUNTER) {
+      return c_.state[index >> 3] & (1 << (index & 7));
+    }
+    return stateC_[index] == 0xff;
+  }
+  static inline uint8_t low(uint8_t index) {
+    if (debounce == DEBOUNCE_VERTICAL_COUNTER) {
+      return !high(index);
+    }
+    return stateC_[index] == 0x00;
+  }
+  static inline uint8_t state(uint8_t index) {
+    if (debounce == DEBOUNCE_VERTICAL_COUNTER) {
+      return high(index) ? 0xff : 0x00;
+    }
+    return stateC_[index];
+  }
+  
+  static inline uint8_t clicked_mask(uint8_t group) { return c_.raised[group]; }
+  static inline uint8_t lowered_mask(uint8_t group) {
+    return c_.lowered[group];
+  }
+  static inline uint8_t raised_mask(uint8_t group) { return c_.raised[group]; }
   static inline int8_t event(uint8_t index) {
     if (lowered(index)) {
       return -1;
@@ -102,9 +202,35 @@ class RotaryEncoderArray {
   }
 
  private:
+  static inline void Decode() {
+    if (decoding == QUADRATURE_HISTORY) {
+      return;
+    }
+    for (uint8_t i = 0; i < size; ++i) {
+      uint8_t a;
+      uint8_t b;
+      if (debounce == DEBOUNCE_VERTICAL_COUNTER) {
+        uint8_t mask = 1 << (i & 7);
+        a = a_.state[i >> 3] & mask ? 1 : 0;
+        b = b_.state[i >> 3] & mask ? 1 : 0;
+      } else {
+        a = stateA_[i] & 1;
+        b = stateB_[i] & 1;
+      }
+      increment_[i] += decoder_[i].Process(a, b);
+    }
+  }
+
   static uint8_t stateA_[size];
   static uint8_t stateB_[size];
   static uint8_t stateC_[size];
+  
+  static VerticalCounterDebouncer<size> a_;
+  static VerticalCounterDebouncer<size> b_;
+  static VerticalCounterDebouncer<size> c_;
+  
+  static QuadratureDecoder<decoding> decoder_[size];
+  static int8_t increment_[size];
 
   DISALLOW_COPY_AND_ASSIGN(RotaryEncoderArray);
 };
@@ -115,8 +241,10 @@ template<
     typename A,
     typename B,
     typename C,
-    uint8_t size>
-  uint8_t RotaryEncoderArray<Load, Clock, A, B, C, size>::stateA_[size];
+    uint8_t size,
+    DebounceMode debounce,
+    QuadratureDecoding decoding>
+  uint8_t RotaryEncoderArray<Load, Clock, A, B, C, size, debounce, decoding>::stateA_[size];
 
 template<
     typename Load,
@@ -124,16 +252,76 @@ template<
     typename A,
     typename B,
     typename C,
-    uint8_t size>
-  uint8_t RotaryEncoderArray<Load, Clock, A, B, C, size>::stateB_[size];
+    uint8_t size,
+    DebounceMode debounce,
+    QuadratureDecoding decoding>
+  uint8_t RotaryEncoderArray<Load, Clock, A, B, C, size, debounce, decoding>::stateB_[size];
 
 template<
     typename Load,
     typename Clock,
     typename A,
     typename B,
-    typename C, uint8_t size>
-  uint8_t RotaryEncoderArray<Load, Clock, A, B, C, size>::stateC_[size];
+    typename C,
+    uint8_t size,
+    DebounceMode debounce,
+    QuadratureDecoding decoding>
+  uint8_t RotaryEncoderArray<Load, Clock, A, B, C, size, debounce, decoding>::stateC_[size];
+
+template<
+    typename Load,
+    typename Clock,
+    typename A,
+    typename B,
+    typename C,
+    uint8_t size,
+    DebounceMode debounce,
+    QuadratureDecoding decoding>
+  VerticalCounterDebouncer<size> RotaryEncoderArray<Load, Clock, A, B, C, size, debounce, decoding>::a_;
+
+template<
+    typename Load,
+    typename Clock,
+    typename A,
+    typename B,
+    typename C,
+    uint8_t size,
+    DebounceMode debounce,
+    QuadratureDecoding decoding>
+  VerticalCounterDebouncer<size> RotaryEncoderArray<Load, Clock, A, B, C, size, debounce, decoding>::b_;
+
+template<
+    typename Load,
+    typename Clock,
+    typename A,
+    typename B,
+    typename C,
+    uint8_t size,
+    DebounceMode debounce,
+    QuadratureDecoding decoding>
+  VerticalCounterDebouncer<size> RotaryEncoderArray<Load, Clock, A, B, C, size, debounce, decoding>::c_;
+
+template<
+    typename Load,
+    typename Clock,
+    typename A,
+    typename B,
+    typename C,
+    uint8_t size,
+    DebounceMode debounce,
+    QuadratureDecoding decoding>
+  QuadratureDecoder<decoding> RotaryEncoderArray<Load, Clock, A, B, C, size, debounce, decoding>::decoder_[size];
+
+template<
+    typename Load,
+    typename Clock,
+    typename A,
+    typename B,
+    typename C,
+    uint8_t size,
+    DebounceMode debounce,
+    QuadratureDecoding decoding>
+  int8_t RotaryEncoderArray<Load, Clock, A, B, C, size, debounce, decoding>::increment_[size];
 
 }  // namespace avrlib
 
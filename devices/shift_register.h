@@ -16,16 +16,37 @@
 // -----------------------------------------------------------------------------
 //
 // Driver for a 8-bits shift register.
+//
+// With the SHIFT_REGISTER_SPI backend, the data is transferred by the hardware
+// SPI peripheral rather than by toggling the Clock and Data pins, which are
+// ignored (the shift registers must be connected to the SCK and MOSI/MISO
+// pins). The latch/load pin is still a regular GPIO. Only 8 or 16 bits
+// registers are supported by this backend.
+//
+// Init() dedicates the SCK, MOSI, MISO and SS pins to the SPI peripheral (SS
+// is kept as an output, as required in master mode), so they can't be used
+// as GPIOs anymore. The data order and clock speed are applied at the
+// beginning of each transfer and the previous settings are restored at the
+// end, so the bus can be shared with other SPI devices (DAC, SD card...) and
+// with shift registers using another data order - as long as a transfer is
+// never interrupted by an ISR using the bus. With this backend, ShiftOut()
+// must be called between Begin() and End().
 
 #ifndef AVRLIB_DEVICES_SHIFT_REGISTER_H_
 #define AVRLIB_DEVICES_SHIFT_REGISTER_H_
 
 #include "avrlib/gpio.h"
 #include "avrlib/size_to_type.h"
+#include "avrlib/spi.h"
 #include "avrlib/time.h"
 
 namespace avrlib {
 
+enum ShiftRegisterBackend {
+  SHIFT_REGISTER_GPIO,
+  SHIFT_REGISTER_SPI
+};
+
 template<typename Latch, typename Clock, typename Data>
 struct BaseShiftRegisterOutput {
   BaseShiftRegisterOutput() { }
@@ -38,13 +59,15 @@ struct BaseShiftRegisterOutput {
 };
 
 template<typename Latch, typename Clock, typename Data,
-         uint8_t size = 8, DataOrder order = LSB_FIRST>
+         uint8_t size = 8, DataOrder order = LSB_FIRST,
+         ShiftRegisterBackend backend = SHIFT_REGISTER_GPIO>
 struct ShiftRegisterOutput : public BaseShiftRegisterOutput<Latch, Clock, Data> {
 };
 
 template<typename Latch, typename Clock, typename Data,
          uint8_t size>
-struct ShiftRegisterOutput<Latch, Clock, Data, size, LSB_FIRST>
+struct ShiftRegisterOutput<Latch, Clock, Data, size, LSB_FIRST,
+                           SHIFT_REGISTER_GPIO>
   : public BaseShiftRegisterOutput<Latch, Clock, Data> {
   ShiftRegisterOutput() { }
   static void ShiftOut(typename DataTypeForSize<size>::Type data) {
@@ -71,7 +94,8 @@ struct ShiftRegisterOutput<Latch, Clock, Data, size, LSB_FIRST>
 };
 
 template<typename Latch, typename Clock, typename Data, uint8_t size>
-struct ShiftRegisterOutput<Latch, Clock, Data, size, MSB_FIRST>
+struct ShiftRegisterOutput<Latch, Clock, Data, size, MSB_FIRST,
+                           SHIFT_REGISTER_GPIO>
   : public BaseShiftRegisterOutput<Latch, Clock, Data> {
   ShiftRegisterOutput() { }
   typedef typename DataTypeForSize<size>::Type T;
@@ -103,6 +127,68 @@ struct ShiftRegisterOutput<Latch, Clock, Data, size, MSB_FIRST>
   }
 };
 
+template<typename Latch, typename Clock, typename Data, uint8_t size,
+         DataOrder order>
+struct ShiftRegisterOutput<Latch, Clock, Data, size, order,
+                           SHIFT_REGISTER_SPI> {
+  ShiftRegisterOutput() { }
+  typedef SpiMaster<Latch, order, 2> Spi;
+  typedef typename DataTypeForSize<size>::Type T;
+  static void Init() {
+    // Only the pins are set up - the settings are applied at each transfer.
+    uint8_t saved_spcr = SPCR;
+    uint8_t saved_spsr = SPSR;
+    Spi::Init();
+    SPCR = saved_spcr;
+    SPSR = saved_spsr;
+  }
+  static void ShiftOut(T data) {
+    if (size > 8) {
+      if (order == LSB_FIRST) {
+        Spi::Send(data & 0xff);
+        Spi::Send(data >> 8);
+      } else {
+        Spi::Send(data >> 8);
+        Spi::Send(data & 0xff);
+      }
+    } else {
+      Spi::Send(data);
+    }
+  }
+  static void Begin() {
+    saved_spcr_ = SPCR;
+    saved_spsr_ = SPSR;
+    Spi::Configure();
+    Spi::Begin();
+  }
+  static void End() {
+    Spi::End();
+    SPCR = saved_spcr_;
+    SPSR = saved_spsr_;
+  }
+  static void Write(T data) {
+    Begin();
+    ShiftOut(data);
+    End();
+  }
+
+ private:
+  static uint8_t saved_spcr_;
+  static uint8_t saved_spsr_;
+};
+
+/* static */
+template<typename Latch, typename Clock, typename Data, uint8_t size,
+         DataOrder order>
+uint8_t ShiftRegisterOutput<Latch, Clock, Data, size, order,
+                            SHIFT_REGISTER_SPI>::saved_spcr_;
+
+/* static */
+template<typename Latch, typename Clock, typename Data, uint8_t size,
+         DataOrder order>
+uint8_t ShiftRegisterOutput<Latch, Clock, Data, size, order,
+                            SHIFT_REGISTER_SPI>::saved_spsr_;
+
 template<typename Load, typename Clock, typename Data>
 struct BaseShiftRegisterInput {
   BaseShiftRegisterInput() { }
@@ -116,13 +202,15 @@ struct BaseShiftRegisterInput {
 };
 
 template<typename Load, typename Clock, typename Data,
-         uint8_t size = 8, DataOrder order = LSB_FIRST>
+         uint8_t size = 8, DataOrder order = LSB_FIRST,
+         ShiftRegisterBackend backend = SHIFT_REGISTER_GPIO>
 struct ShiftRegisterInput : public BaseShiftRegisterInput<Load, Clock, Data> {
 };
 
 template<typename Load, typename Clock, typename Data,
          uint8_t size>
-struct ShiftRegisterInput<Load, Clock, Data, size, LSB_FIRST>
+struct ShiftRegisterInput<Load, Clock, Data, size, LSB_FIRST,
+                          SHIFT_REGISTER_GPIO>
   : public BaseShiftRegisterInput<Load, Clock, Data> {
   ShiftRegisterInput() { }
   typedef typename DataTypeForSize<size>::Type T;
@@ -142,7 +230,8 @@ struct ShiftRegisterInput<Load, Clock, Data, size, LSB_FIRST>
 };
 
 template<typename Load, typename Clock, typename Data, uint8_t size>
-struct ShiftRegisterInput<Load, Clock, Data, size, MSB_FIRST>
+struct ShiftRegisterInput<Load, Clock, Data, size, MSB_FIRST,
+                          SHIFT_REGISTER_GPIO>
   : public BaseShiftRegisterInput<Load, Clock, Data> {
   ShiftRegisterInput() { }
   typedef typename DataTypeForSize<size>::Type T;
@@ -164,6 +253,51 @@ struct ShiftRegisterInput<Load, Clock, Data, size, MSB_FIRST>
   }
 };
 
+// With LSB_FIRST, the first bit read ends up in the MSB of the result (and
+// vice versa), which is the opposite of the SPI convention.
+template<typename Load, typename Clock, typename Data, uint8_t size,
+         DataOrder order>
+struct ShiftRegisterInput<Load, Clock, Data, size, order,
+                          SHIFT_REGISTER_SPI> {
+  ShiftRegisterInput() { }
+  typedef SpiMaster<
+      Load,
+      order == LSB_FIRST ? MSB_FIRST : LSB_FIRST,
+      2> Spi;
+  typedef typename DataTypeForSize<size>::Type T;
+  static void Init() {
+    // Only the pins are set up - the settings are applied at each transfer.
+    uint8_t saved_spcr = SPCR;
+    uint8_t saved_spsr = SPSR;
+    Spi::Init();
+    SPCR = saved_spcr;
+    SPSR = saved_spsr;
+  }
+  static T Read() {
+    uint8_t saved_spcr = SPCR;
+    uint8_t saved_spsr = SPSR;
+    Spi::Configure();
+    // Strobe load pin.
+    Load::Low();
+    Load::High();
+    T data;
+    if (size > 8) {
+      if (order == LSB_FIRST) {
+        data = T(Spi::Receive()) << 8;
+        data |= Spi::Receive();
+      } else {
+        data = Spi::Receive();
+        data |= T(Spi::Receive()) << 8;
+      }
+    } else {
+      data = Spi::Receive();
+    }
+    SPCR = saved_spcr;
+    SPSR = saved_spsr;
+    return data;
+  }
+};
+
 }  // namespace avrlib
 
 #endif  // AVRLIB_DEVICES_SHIFT_REGISTER_H_
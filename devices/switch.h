@@ -18,6 +18,17 @@
 // Debouncing for:
 // - A single switch.
 // - An array of switches.
+//
+// Two debouncing algorithms are available for arrays of switches:
+// - DEBOUNCE_HISTORY keeps the last 8 readings of each switch in a byte.
+// - DEBOUNCE_VERTICAL_COUNTER processes the switches 8 at a time with 2-bit
+// vertical counters. This needs 5 bytes of state per 8 switches (debounced
+// state, 2 counter bits, lowered and raised masks), and gives bitmasks of the
+// switches which have been pressed or released at the last scan. The history
+// byte returned by state() is then reduced to 0x00 or 0xff.
+//
+// DebouncedSwitches supports up to 16 switches: DataTypeForSize, used for the
+// shift register words and the edge masks, does not go beyond 16 bits.
 
 #ifndef AVRLIB_DEVICES_SWITCHES_H_
 #define AVRLIB_DEVICES_SWITCHES_H_
@@ -28,6 +39,50 @@
 #include "avrlib/size_to_type.h"
 
 namespace avrlib {
+
+enum DebounceMode {
+  DEBOUNCE_HISTORY,
+  DEBOUNCE_VERTICAL_COUNTER
+};
+
+// Bit-parallel debouncer for groups of 8 inputs. For each input, a 2-bit
+// counter (whose bits are stored in count_0 and count_1) counts the number of
+// consecutive readings differing from the debounced state, and the state
+// toggles after 4 such readings. Inputs beyond num_inputs in the last group
+// must be read as 1 (released), otherwise they are debounced as pressed
+// switches.
+template<uint8_t num_inputs>
+struct VerticalCounterDebouncer {
+  enum {
+    num_groups = (num_inputs + 7) >> 3
+  };
+
+  inline void Init() {
+    memset(state, 0xff, sizeof(state));
+    memset(count_0, 0, sizeof(count_0));
+    memset(count_1, 0, sizeof(count_1));
+    memset(lowered, 0, sizeof(lowered));
+    memset(raised, 0, sizeof(raised));
+  }
+
+  inline void Process(uint8_t group, uint8_t reading) {
+    uint8_t delta = reading ^ state[group];
+    uint8_t c_1 = (count_1[group] ^ count_0[group]) & delta;
+    uint8_t c_0 = ~count_0[group] & delta;
+    uint8_t toggle = delta & ~(c_0 | c_1);
+    count_0[group] = c_0;
+    count_1[group] = c_1;
+    state[group] ^= toggle;
+    lowered[group] = toggle & ~state[group];
+    raised[group] = toggle & state[group];
+  }
+
+  uint8_t state[num_groups];
+  uint8_t count_0[num_groups];
+  uint8_t count_1[num_groups];
+  uint8_t lowered[num_groups];
+  uint8_t raised[num_groups];
+};
   
 template<typename Input, bool enable_pull_up = true>
 class DebouncedSwitch {
@@ -66,18 +121,29 @@ template<typename Input, bool enable_pull_up>
 uint8_t DebouncedSwitch<Input, enable_pull_up>::state_;
 
 
-template<typename Load, typename Clock, typename Data, uint8_t num_inputs, DataOrder order = LSB_FIRST>
+// In DEBOUNCE_VERTICAL_COUNTER mode, bit num_inputs - 1 - i of the edge masks
+// corresponds to switch i - as in the value passed to Process().
+template<typename Load, typename Clock, typename Data, uint8_t num_inputs, DataOrder order = LSB_FIRST, ShiftRegisterBackend backend = SHIFT_REGISTER_GPIO, DebounceMode debounce = DEBOUNCE_HISTORY>
 class DebouncedSwitches {
   typedef typename DataTypeForSize<num_inputs>::Type T;
   typedef ShiftRegisterInput<
-      Load, Clock, Data, 8 * sizeof(T), order> Register;
+      Load, Clock, Data, 8 * sizeof(T), order, backend> Register;
 
  public:
+  enum {
+    input_mask = T(~T(0)) >> (8 * sizeof(T) - num_inputs)
+  };
+
   DebouncedSwitches() { }
 
   static inline void Init() {
+    STATIC_ASSERT(num_inputs <= 16);
     Register::Init();
-    memset(state_, 0xff, sizeof(state_));
+    if (debounce == DEBOUNCE_VERTICAL_COUNTER) {
+      debouncer_.Init();
+    } else {
+      memset(state_, 0xff, sizeof(state_));
+    }
   }
   
   static inline T ReadRegister() {
@@ -85,7 +151,17 @@ class DebouncedSwitches {
   }
   
   static inline void Process(T value) {
-    T mask = 1 << (num_inputs - 1);
+    if (debounce == DEBOUNCE_VERTICAL_COUNTER) {
+      // The unused bits are padded with 1s, so that they are never seen as
+      // pressed switches.
+      value |= ~T(input_mask);
+      for (uint8_t group = 0; group < sizeof(T); ++group) {
+        debouncer_.Process(group, value);
+        value >>= 8;
+      }
+      return;
+    }
+    T mask = T(1) << (num_inputs - 1);
     for (uint8_t i = 0; i < num_inputs; ++i) {
       state_[i] <<= 1;
       if (value & mask) {
@@ -99,11 +175,42 @@ class DebouncedSwitches {
     Process(ReadRegister());
   }
   
-  static inline uint8_t lowered(uint8_t index) { return state_[index] == 0x80; }
-  static inline uint8_t raised(uint8_t index) { return state_[index] == 0x7f; }
-  static inline uint8_t high(uint8_t index) { return state_[index] == 0xff; }
-  static inline uint8_t low(uint8_t index) { return state_[index] == 0x00; }
-  static inline uint8_t state(uint8_t index) { return state_[index]; }
+  static inline uint8_t lowered(uint8_t index) {
+    if (debounce == DEBOUNCE_VERTICAL_COUNTER) {
+      return test(debouncer_.lowered, index);
+    }
+    return state_[index] == 0x80;
+  }
+  static inline uint8_t raised(uint8_t index) {
+    if (debounce == DEBOUNCE_VERTICAL_COUNTER) {
+      return test(debouncer_.raised, index);
+    }
+    return state_[index] == 0x7f;
+  }
+  static inline uint8_t high(uint8_t index) {
+    if (debounce == DEBOUNCE_VERTICAL_COUNTER) {
+      return test(debouncer_.state, index);
+    }
+    return state_[index] == 0xff;
+  }
+  static inline uint8_t low(uint8_t index) {
+    if (debounce == DEBOUNCE_VERTICAL_COUNTER) {
+      return !test(debouncer_.state, index);
+    }
+    return state_[index] == 0x00;
+  }
+  static inline uint8_t state(uint8_t index) {
+    if (debounce == DEBOUNCE_VERTICAL_COUNTER) {
+      return high(index) ? 0xff : 0x00;
+    }
+    return state_[index];
+  }
+  
+  // Bitmasks of the switches lowered/raised at the last scan, in vertical
+  // counter mode.
+  static inline T lowered_mask() { return mask(debouncer_.lowered); }
+  static inline T raised_mask() { return mask(debouncer_.raised); }
+  
   static inline int8_t event(uint8_t index) {
     if (lowered(index)) {
       return -1;
@@ -114,13 +221,30 @@ class DebouncedSwitches {
   }
 
  private:
+  static inline uint8_t test(const uint8_t* bits, uint8_t index) {
+    uint8_t bit = num_inputs - 1 - index;
+    return bits[bit >> 3] & (1 << (bit & 7));
+  }
+  
+  static inline T mask(const uint8_t* bits) {
+    T value = 0;
+    for (uint8_t group = sizeof(T); group > 0; --group) {
+      value = (value << 8) | bits[group - 1];
+    }
+    return value & input_mask;
+  }
+  
   static uint8_t state_[num_inputs];
+  static VerticalCounterDebouncer<8 * sizeof(T)> debouncer_;
 
   DISALLOW_COPY_AND_ASSIGN(DebouncedSwitches);
 };
 
-template<typename Load, typename Clock, typename Data, uint8_t num_inputs, DataOrder order>
-uint8_t DebouncedSwitches<Load, Clock, Data, num_inputs, order>::state_[num_inputs];
+template<typename Load, typename Clock, typename Data, uint8_t num_inputs, DataOrder order, ShiftRegisterBackend backend, DebounceMode debounce>
+uint8_t DebouncedSwitches<Load, Clock, Data, num_inputs, order, backend, debounce>::state_[num_inputs];
+
+template<typename Load, typename Clock, typename Data, uint8_t num_inputs, DataOrder order, ShiftRegisterBackend backend, DebounceMode debounce>
+VerticalCounterDebouncer<8 * sizeof(typename DataTypeForSize<num_inputs>::Type)> DebouncedSwitches<Load, Clock, Data, num_inputs, order, backend, debounce>::debouncer_;
 
 }  // namespace avrlib
 
@@ -0,0 +1,189 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Scanner for a matrix of up to 16 rows x 8 columns of switches.
+//
+// RowDriver is an output device with Init() and Write(value) methods (for
+// example a ShiftRegisterOutput), driving the rows. The scanned row is driven
+// low, the others high. ColumnReader is an input device with Init() and Read()
+// methods (for example a ShiftRegisterInput), reading the columns, pulled up.
+// Bit c of the value read corresponds to column c.
+//
+// Each call to Tick() reads the row selected at the previous call - which has
+// had a whole tick to settle - then selects the next row. Calling Tick() at
+// rows kHz thus scans the whole matrix at 1 kHz. The switches of a row are
+// debounced together with vertical counters.
+//
+// In a matrix without diodes, 3 switches pressed at the corners of a rectangle
+// make the fourth corner look pressed. Such ambiguous switches (any pressed
+// switch sharing its row and column with other pressed switches forming a
+// rectangle) are not reported until the ambiguity is resolved.
+//
+// The presses and releases are recorded by Tick() and sent to an EventQueue by
+// PushEvents(), which can be called from the main loop, or from the ISR right
+// after Tick().
+
+#ifndef AVRLIB_DEVICES_SWITCH_MATRIX_H_
+#define AVRLIB_DEVICES_SWITCH_MATRIX_H_
+
+#include <avr/interrupt.h>
+#include <string.h>
+
+#include "avrlib/base.h"
+#include "avrlib/devices/switch.h"
+#include "avrlib/size_to_type.h"
+#include "avrlib/ui/event_queue.h"
+
+namespace avrlib {
+
+template<typename RowDriver, typename ColumnReader, uint8_t rows, uint8_t cols>
+class SwitchMatrix {
+ public:
+  typedef typename DataTypeForSize<rows>::Type RowMask;
+
+  enum {
+    num_switches = rows * cols,
+    column_mask = (1 << cols) - 1
+  };
+
+  SwitchMatrix() { }
+
+  static inline void Init() {
+    RowDriver::Init();
+    ColumnReader::Init();
+    debouncer_.Init();
+    memset(reported_, 0, sizeof(reported_));
+    for (uint8_t i = 0; i < rows; ++i) {
+      pressed_events_[i] = 0;
+      released_events_[i] = 0;
+    }
+    row_ = 0;
+    RowDriver::Write(~RowMask(1));
+  }
+
+  static inline void Tick() {
+    uint8_t row = row_;
+    debouncer_.Process(row, ColumnReader::Read() | ~column_mask);
+
+    // Select the next row as early as possible to give it time to settle.
+    row_ = row + 1 == rows ? 0 : row + 1;
+    RowDriver::Write(~(RowMask(1) << row_));
+
+    // Find the switches which can't be told apart from ghosts: pressed
+    // switches sharing 2 or more columns with another row.
+    uint8_t pressed = ~debouncer_.state[row] & column_mask;
+    uint8_t ambiguous = 0;
+    if (pressed & (pressed - 1)) {
+      for (uint8_t i = 0; i < rows; ++i) {
+        uint8_t shared = pressed & ~debouncer_.state[i];
+        if (i != row && (shared & (shared - 1))) {
+          ambiguous |= shared;
+        }
+      }
+    }
+    uint8_t released = reported_[row] & ~pressed;
+    pressed &= ~ambiguous & ~reported_[row];
+    reported_[row] = (reported_[row] | pressed) & ~released;
+    pressed_events_[row] |= pressed;
+    released_events_[row] |= released;
+  }
+
+  static inline uint8_t pressed(uint8_t row, uint8_t col) {
+    return reported_[row] & (1 << col);
+  }
+
+  static inline uint8_t pressed(uint8_t index) {
+    return pressed(index / cols, index % cols);
+  }
+
+  // Switch (row, col) has the id first_id + row * cols + col. The value is 1
+  // for a press, and 0 for a release. The ids must fit in the event format of
+  // the queue: matrices of more than 64 switches need EVENT_FORMAT_WIDE.
+  //
+  // When a switch has been both pressed and released since the last call, the
+  // two events are sent in the order in which they happened, so that the last
+  // one matches the current state of the switch.
+  template<typename Queue>
+  static void PushEvents(uint8_t first_id = 0) {
+    STATIC_ASSERT(num_switches <= Queue::num_control_ids);
+    uint8_t id = first_id;
+    for (uint8_t row = 0; row < rows; ++row) {
+      uint8_t old_sreg = SREG;
+      cli();
+      uint8_t pressed = pressed_events_[row];
+      uint8_t released = released_events_[row];
+      uint8_t state = reported_[row];
+      pressed_events_[row] = 0;
+      released_events_[row] = 0;
+      SREG = old_sreg;
+      if (pressed | released) {
+        uint8_t mask = 1;
+        for (uint8_t col = 0; col < cols; ++col) {
+          if ((pressed & released & mask) && (state & mask)) {
+            Queue::AddEvent(CONTROL_SWITCH, id + col, 0);
+            Queue::AddEvent(CONTROL_SWITCH, id + col, 1);
+          } else {
+            if (pressed & mask) {
+              Queue::AddEvent(CONTROL_SWITCH, id + col, 1);
+            }
+            if (released & mask) {
+              Queue::AddEvent(CONTROL_SWITCH, id + col, 0);
+            }
+          }
+          mask <<= 1;
+        }
+      }
+      id += cols;
+    }
+  }
+
+ private:
+  static uint8_t row_;
+  static VerticalCounterDebouncer<rows * 8> debouncer_;
+  static uint8_t reported_[rows];
+  static volatile uint8_t pressed_events_[rows];
+  static volatile uint8_t released_events_[rows];
+
+  DISALLOW_COPY_AND_ASSIGN(SwitchMatrix);
+};
+
+/* static */
+template<typename RowDriver, typename ColumnReader, uint8_t rows, uint8_t cols>
+uint8_t SwitchMatrix<RowDriver, ColumnReader, rows, cols>::row_;
+
+/* static */
+template<typename RowDriver, typename ColumnReader, uint8_t rows, uint8_t cols>
+VerticalCounterDebouncer<rows * 8> SwitchMatrix<RowDriver, ColumnReader, rows,
+                                                cols>::debouncer_;
+
+/* static */
+template<typename RowDriver, typename ColumnReader, uint8_t rows, uint8_t cols>
+uint8_t SwitchMatrix<RowDriver, ColumnReader, rows, cols>::reported_[rows];
+
+/* static */
+template<typename RowDriver, typename ColumnReader, uint8_t rows, uint8_t cols>
+volatile uint8_t SwitchMatrix<RowDriver, ColumnReader, rows,
+                              cols>::pressed_events_[rows];
+
+/* static */
+template<typename RowDriver, typename ColumnReader, uint8_t rows, uint8_t cols>
+volatile uint8_t SwitchMatrix<RowDriver, ColumnReader, rows,
+                              cols>::released_events_[rows];
+
+}  // namespace avrlib
+
+#endif  // AVRLIB_DEVICES_SWITCH_MATRIX_H_
@@ -0,0 +1,361 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// MIDI stream parser.
+//
+// The parsed messages are dispatched to the static methods of a Handler class.
+// MidiHandler provides empty implementations of all of them, so a handler only
+// needs to define the methods for the messages it is interested in:
+//
+// struct MyHandler : public MidiHandler {
+//   static void NoteOn(uint8_t channel, uint8_t note, uint8_t velocity) { }
+//   static void Clock() { }
+// };
+//
+// typedef MidiStreamParser<MyHandler> Parser;
+//
+// Then, in the main loop:
+// Parser::ProcessInput<Serial::Input>();
+//
+// The parser supports running status, and real-time messages interleaved
+// anywhere in the stream - including between the data bytes of a message or
+// inside a sysex. A note on with a null velocity is dispatched as a note off.
+// The payload of sysex messages (without the 0xf0 and 0xf7 bytes) is
+// delivered by chunks of up to sysex_chunk_size bytes, between calls to
+// SysExStart() and SysExEnd(). A sysex interrupted by another status byte is
+// terminated as if a 0xf7 had been received.
+//
+// To reduce the jitter of MIDI clock, real-time messages can be dispatched
+// directly from the reception interrupt, instead of waiting in the input buffer
+// until the next call to ProcessInput(), with a MidiRealTimeRxFilter:
+//
+// typedef Serial<SerialPort0, 31250, BUFFERED, POLLED, false,
+//                MidiRealTimeRxFilter<Parser> > MidiSerial;
+// ISR(USART_RX_vect) { MidiSerial::Received(); }
+//
+// DISABLE_DEFAULT_UART_RX_ISR must be defined when building serial.cc: its
+// default reception interrupt handlers bypass the filter, and would collide
+// with this one. The real-time methods of the handler are then called from the
+// interrupt, and must be kept short.
+
+#ifndef AVRLIB_MIDI_MIDI_H_
+#define AVRLIB_MIDI_MIDI_H_
+
+#include "avrlib/base.h"
+
+namespace avrlib {
+
+const uint8_t kMidiClock = 0xf8;
+const uint8_t kMidiStart = 0xfa;
+const uint8_t kMidiContinue = 0xfb;
+const uint8_t kMidiStop = 0xfc;
+const uint8_t kMidiActiveSensing = 0xfe;
+const uint8_t kMidiReset = 0xff;
+
+struct MidiHandler {
+  static void NoteOn(
+      uint8_t /* channel */, uint8_t /* note */, uint8_t /* velocity */) { }
+  static void NoteOff(
+      uint8_t /* channel */, uint8_t /* note */, uint8_t /* velocity */) { }
+  static void Aftertouch(
+      uint8_t /* channel */, uint8_t /* note */, uint8_t /* value */) { }
+  static void ChannelAftertouch(uint8_t /* channel */, uint8_t /* value */) { }
+  static void ControlChange(
+      uint8_t /* channel */, uint8_t /* controller */, uint8_t /* value */) { }
+  static void ProgramChange(uint8_t /* channel */, uint8_t /* program */) { }
+  // 14-bit value, centered on 8192.
+  static void PitchBend(uint8_t /* channel */, uint16_t /* value */) { }
+
+  static void MtcQuarterFrame(uint8_t /* value */) { }
+  static void SongPosition(uint16_t /* position */) { }
+  static void SongSelect(uint8_t /* song */) { }
+  static void TuneRequest() { }
+
+  static void SysExStart() { }
+  static void SysExData(const uint8_t* /* data */, uint8_t /* size */) { }
+  static void SysExEnd() { }
+
+  static void Clock() { }
+  static void Start() { }
+  static void Continue() { }
+  static void Stop() { }
+  static void ActiveSensing() { }
+  static void Reset() { }
+};
+
+// Timer used to instrument MidiRealTimeRxFilter. NoLatencyTimer disables the
+// instrumentation.
+struct NoLatencyTimer {
+  static inline uint8_t value() { return 0; }
+};
+
+template<typename LatencyTimer>
+struct IsLatencyTimerEnabled {
+  enum {
+    value = 1
+  };
+};
+
+template<>
+struct IsLatencyTimerEnabled<NoLatencyTimer> {
+  enum {
+    value = 0
+  };
+};
+
+template<typename Handler, uint8_t sysex_chunk_size = 16>
+class MidiStreamParser {
+ public:
+  MidiStreamParser() { }
+
+  static void Init() {
+    running_status_ = 0;
+    data_size_ = 0;
+    expected_data_size_ = 0;
+    in_sysex_ = 0;
+    sysex_size_ = 0;
+  }
+
+  // Parses the bytes available in Input (for example Serial::Input). The
+  // number of available bytes is read only once, and at most max_size bytes
+  // are parsed, to bound the time spent in this function. Returns the number
+  // of bytes parsed.
+  template<typename Input>
+  static uint8_t ProcessInput(uint8_t max_size = 0xff) {
+    uint8_t size = Input::readable();
+    if (size > max_size) {
+      size = max_size;
+    }
+    for (uint8_t i = size; i; --i) {
+      PushByte(Input::ImmediateRead());
+    }
+    return size;
+  }
+
+  static void PushByte(uint8_t byte) {
+    if (!(byte & 0x80)) {
+      if (in_sysex_) {
+        sysex_buffer_[sysex_size_++] = byte;
+        if (sysex_size_ == sysex_chunk_size) {
+          FlushSysEx();
+        }
+      } else if (running_status_) {
+        data_[data_size_++] = byte;
+        if (data_size_ == expected_data_size_) {
+          MessageReceived();
+        }
+      }
+      return;
+    }
+
+    if (byte >= 0xf8) {
+      // Real-time messages do not affect the running status.
+      DispatchRealTime(byte);
+      return;
+    }
+
+    if (in_sysex_) {
+      FlushSysEx();
+      in_sysex_ = 0;
+      Handler::SysExEnd();
+    }
+    running_status_ = 0;
+    data_size_ = 0;
+    if (byte == 0xf0) {
+      in_sysex_ = 1;
+      Handler::SysExStart();
+    } else if (byte == 0xf6) {
+      Handler::TuneRequest();
+    } else if (byte < 0xf0 || (byte >= 0xf1 && byte <= 0xf3)) {
+      running_status_ = byte;
+      expected_data_size_ = ((byte & 0xe0) == 0xc0 ||
+                             byte == 0xf1 || byte == 0xf3) ? 1 : 2;
+    }
+  }
+
+  static inline void DispatchRealTime(uint8_t byte) {
+    switch (byte) {
+      case kMidiClock:
+        Handler::Clock();
+        break;
+      case kMidiStart:
+        Handler::Start();
+        break;
+      case kMidiContinue:
+        Handler::Continue();
+        break;
+      case kMidiStop:
+        Handler::Stop();
+        break;
+      case kMidiActiveSensing:
+        Handler::ActiveSensing();
+        break;
+      case kMidiReset:
+        Handler::Reset();
+        break;
+    }
+  }
+
+ private:
+  static void MessageReceived() {
+    uint8_t status = running_status_;
+    uint8_t channel = status & 0x0f;
+    data_size_ = 0;
+    switch (status & 0xf0) {
+      case 0x80:
+        Handler::NoteOff(channel, data_[0], data_[1]);
+        break;
+      case 0x90:
+        if (data_[1]) {
+          Handler::NoteOn(channel, data_[0], data_[1]);
+        } else {
+          Handler::NoteOff(channel, data_[0], 0);
+        }
+        break;
+      case 0xa0:
+        Handler::Aftertouch(channel, data_[0], data_[1]);
+        break;
+      case 0xb0:
+        Handler::ControlChange(channel, data_[0], data_[1]);
+        break;
+      case 0xc0:
+        Handler::ProgramChange(channel, data_[0]);
+        break;
+      case 0xd0:
+        Handler::ChannelAftertouch(channel, data_[0]);
+        break;
+      case 0xe0:
+        Handler::PitchBend(channel, data_[0] | (uint16_t(data_[1]) << 7));
+        break;
+      case 0xf0:
+        // System common messages do not set the running status.
+        running_status_ = 0;
+        if (status == 0xf1) {
+          Handler::MtcQuarterFrame(data_[0]);
+        } else if (status == 0xf2) {
+          Handler::SongPosition(data_[0] | (uint16_t(data_[1]) << 7));
+        } else {
+          Handler::SongSelect(data_[0]);
+        }
+        break;
+    }
+  }
+
+  static inline void FlushSysEx() {
+    if (sysex_size_) {
+      Handler::SysExData(sysex_buffer_, sysex_size_);
+      sysex_size_ = 0;
+    }
+  }
+
+  static uint8_t running_status_;
+  static uint8_t data_[2];
+  static uint8_t data_size_;
+  static uint8_t expected_data_size_;
+  static uint8_t in_sysex_;
+  static uint8_t sysex_size_;
+  static uint8_t sysex_buffer_[sysex_chunk_size];
+
+  DISALLOW_COPY_AND_ASSIGN(MidiStreamParser);
+};
+
+/* static */
+template<typename Handler, uint8_t sysex_chunk_size>
+uint8_t MidiStreamParser<Handler, sysex_chunk_size>::running_status_;
+
+/* static */
+template<typename Handler, uint8_t sysex_chunk_size>
+uint8_t MidiStreamParser<Handler, sysex_chunk_size>::data_[2];
+
+/* static */
+template<typename Handler, uint8_t sysex_chunk_size>
+uint8_t MidiStreamParser<Handler, sysex_chunk_size>::data_size_;
+
+/* static */
+template<typename Handler, uint8_t sysex_chunk_size>
+uint8_t MidiStreamParser<Handler, sysex_chunk_size>::expected_data_size_;
+
+/* static */
+template<typename Handler, uint8_t sysex_chunk_size>
+uint8_t MidiStreamParser<Handler, sysex_chunk_size>::in_sysex_;
+
+/* static */
+template<typename Handler, uint8_t sysex_chunk_size>
+uint8_t MidiStreamParser<Handler, sysex_chunk_size>::sysex_size_;
+
+/* static */
+template<typename Handler, uint8_t sysex_chunk_size>
+uint8_t MidiStreamParser<Handler, sysex_chunk_size>::sysex_buffer_[
+    sysex_chunk_size];
+
+// Serial RxFilter (see serial.h) dispatching the real-time messages (0xf8 to
+// 0xff) to Dispatcher::DispatchRealTime() - for example a MidiStreamParser.
+// The other bytes are queued in the input buffer. LatencyTimer is a free
+// running Timer<n>, used to measure the time, in timer ticks, between the
+// entry in the reception interrupt (Timestamp() is sampled by
+// SerialInput::Received() before the UART registers are read) and the call to
+// the handler.
+template<typename Dispatcher, typename LatencyTimer = NoLatencyTimer>
+class MidiRealTimeRxFilter {
+ public:
+  enum {
+    instrumented = IsLatencyTimerEnabled<LatencyTimer>::value
+  };
+
+  MidiRealTimeRxFilter() { }
+
+  static inline uint8_t Timestamp() {
+    return instrumented ? LatencyTimer::value() : 0;
+  }
+
+  static inline uint8_t Filter(uint8_t byte, uint8_t timestamp) {
+    if (byte < 0xf8) {
+      return 0;
+    }
+    if (instrumented) {
+      uint8_t latency = LatencyTimer::value() - timestamp;
+      last_latency_ = latency;
+      if (latency > max_latency_) {
+        max_latency_ = latency;
+      }
+    }
+    Dispatcher::DispatchRealTime(byte);
+    return 1;
+  }
+
+  static inline uint8_t last_latency() { return last_latency_; }
+  static inline uint8_t max_latency() { return max_latency_; }
+  static inline void ResetStatistics() { max_latency_ = 0; }
+
+ private:
+  static volatile uint8_t last_latency_;
+  static volatile uint8_t max_latency_;
+
+  DISALLOW_COPY_AND_ASSIGN(MidiRealTimeRxFilter);
+};
+
+/* static */
+template<typename Dispatcher, typename LatencyTimer>
+volatile uint8_t MidiRealTimeRxFilter<Dispatcher, LatencyTimer>::last_latency_;
+
+/* static */
+template<typename Dispatcher, typename LatencyTimer>
+volatile uint8_t MidiRealTimeRxFilter<Dispatcher, LatencyTimer>::max_latency_;
+
+}  // namespace avrlib
+
+#endif  // AVRLIB_MIDI_MIDI_H_
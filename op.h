@@ -21,7 +21,10 @@
 #ifndef AVRLIB_OP_H_
 #define AVRLIB_OP_H_
 
+// The portable implementations are used for the host builds (tests).
+#ifdef __AVR__
 #define USE_OPTIMIZED_OP
+#endif  // __AVR__
 
 #include <avr/pgmspace.h>
 
@@ -608,8 +611,8 @@ static inline uint24_t U24Sub(uint24_t a, uint24_t b) {
   bv += b.fractional;
   
   uint32_t difference = av - bv;
-  result.integral = sum >> 8;
-  result.fractional = sum & 0xff;
+  result.integral = difference >> 8;
+  result.fractional = difference & 0xff;
   return result;
 }
 
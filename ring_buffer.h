@@ -68,7 +68,7 @@ class RingBuffer : public Input, Output {
     write_ptr_ = (w + 2) & (size - 1);
   }
   
-  static inline uint8_t Requested() { return 0; }
+  static inline void Requested() { }
   static inline Value Read() {
     while (!readable());
     return ImmediateRead();
@@ -92,6 +92,12 @@ class RingBuffer : public Input, Output {
   static inline void Flush() {
     write_ptr_ = read_ptr_;
   }
+  
+  // Direct access to the buffer, for owners which need to modify items which
+  // have been written but not read yet.
+  static inline uint8_t read_ptr() { return read_ptr_; }
+  static inline uint8_t write_ptr() { return write_ptr_; }
+  static inline Value* data() { return buffer_; }
  private:
   static Value buffer_[size];
   static volatile uint8_t read_ptr_;
@@ -58,4 +58,40 @@ ISR(USART1_RX_vect) {
 
 #endif  // SERIAL_RX_1
 
-#endif  // DISABLE_DEFAULT_UART_RX_ISR
\ No newline at end of file
+#endif  // DISABLE_DEFAULT_UART_RX_ISR
+
+
+#ifndef DISABLE_DEFAULT_UART_TX_ISR
+
+#ifdef SERIAL_TX_0
+
+#if defined(HAS_USART0) && defined(HAS_USART1)
+
+ISR(USART0_UDRE_vect) {
+  SerialOutput<SerialPort0>::Requested();
+}
+
+#elif defined(HAS_USART0)
+
+ISR(USART_UDRE_vect) {
+  SerialOutput<SerialPort0>::Requested();
+}
+
+#endif  // HAS_USART
+
+#endif  // SERIAL_TX_0
+
+
+#ifdef SERIAL_TX_1
+
+#ifdef HAS_USART1
+
+ISR(USART1_UDRE_vect) {
+  SerialOutput<SerialPort1>::Requested();
+}
+
+#endif  // HAS_USART1
+
+#endif  // SERIAL_TX_1
+
+#endif  // DISABLE_DEFAULT_UART_TX_ISR
@@ -40,36 +40,99 @@
 // Flushing a buffer:
 // Serial::InputBuffer::Flush()
 //
-// TODO(pichenettes): Buffered writes not supported for now (should look up
-// the right interrupt handler).
+// Filtering received bytes (for buffered reads):
+// typedef Serial<SerialPort0, 31250, BUFFERED, POLLED, false, MyFilter> Serial;
+// MyFilter::Filter(byte, timestamp) is called from the reception interrupt for
+// each byte, and the byte is queued in the input buffer only if it returns 0.
+// This allows urgent data to be processed without waiting for the main loop.
+// timestamp is the value returned by MyFilter::Timestamp(), sampled on entry
+// in the interrupt, before the UART registers are read. The default reception
+// interrupt handlers do not use any filter, so they must be disabled with
+// DISABLE_DEFAULT_UART_RX_ISR and replaced by:
+// ISR(USART_RX_vect) { Serial::Received(); }
+//
+// Reception statistics (for buffered reads):
+// Serial::rx_errors(SERIAL_RX_ERROR_OVERRUN)  // Number of bytes lost because
+//   the interrupt was not serviced in time. The other counters are the framing
+//   errors, the parity errors, and the bytes dropped because the input buffer
+//   was full. Bytes received with a framing or parity error are still queued.
+// Serial::ResetRxErrors()
+// A SerialRxGapHistogram<Timer<2> > filter records the distribution of the
+// time elapsed between the reception of two consecutive bytes, in timer ticks.
+//
+// Buffered writes:
+// typedef Serial<SerialPort0, 31250, POLLED, BUFFERED> Serial;
+// Bytes written are queued in the output buffer. Serial::Requested() sends the
+// next one, and must be called periodically - for example from a timer
+// interrupt. It does nothing while the data register is not empty.
+//
+// Interrupt-driven writes:
+// typedef Serial<SerialPort0, 31250, POLLED, INTERRUPT_DRIVEN> Serial;
+// Bytes written are queued in the output buffer, and sent by the data register
+// empty interrupt, which is enabled whenever the buffer is not empty. Write()
+// blocks only when the output buffer is full. The interrupt handler must
+// exist, or the first write resets the MCU: it is defined in serial.cc when
+// SERIAL_TX_0 / SERIAL_TX_1 is defined. Alternatively, define
+// DISABLE_DEFAULT_UART_TX_ISR and provide it:
+// ISR(USART_UDRE_vect) { Serial::Requested(); }
+//
+// Bulk writes (for interrupt-driven writes):
+// Serial::SendBuffer(data, size, progmem)  // Returns immediately.
+// Serial::buffer_sent()  // 1 when the last byte of the buffer has been sent.
+// The bytes are read by the interrupt handler directly from the buffer (in RAM
+// or in flash), which must thus be left untouched until buffer_sent() returns
+// 1. Only one buffer can be sent at a time: SendBuffer() waits until the
+// previous one has been sent. Bytes written with Write() during the transfer
+// are sent first (interleaved with the buffer) - this is fine for MIDI
+// real-time messages, but any other message should wait for buffer_sent().
 
 #ifndef AVRLIB_SERIAL_H_
 #define AVRLIB_SERIAL_H_
 
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
 #include "avrlib/avrlib.h"
 #include "avrlib/gpio.h"
 #include "avrlib/ring_buffer.h"
+#include "avrlib/time.h"
 
 namespace avrlib {
 
 const uint8_t kSerialOutputBufferSize = 32;
 const uint8_t kSerialInputBufferSize = 32;
 
+// Error flags in the UCSRnA registers.
+const uint8_t kSerialFramingErrorFlag = 0x10;
+const uint8_t kSerialDataOverrunFlag = 0x08;
+const uint8_t kSerialParityErrorFlag = 0x04;
+
+enum SerialRxError {
+  SERIAL_RX_ERROR_FRAMING,
+  SERIAL_RX_ERROR_OVERRUN,
+  SERIAL_RX_ERROR_PARITY,
+  SERIAL_RX_ERROR_BUFFER_FULL,
+  SERIAL_RX_ERROR_LAST
+};
+
 // Low-level interface to the low-level UART registers. Several specializations
 // may be declared for each serial port. This class could theoretically be used
 // for non-blocking write or polling reads.
 template<typename TxEnableBit, typename TxReadyBit,
          typename RxEnableBit, typename RxReadyBit,
          typename RxInterruptBit,
+         typename TxInterruptBit,
          typename TurboBit,
          typename PrescalerRegisterH, typename PrescalerRegisterL,
          typename DataRegister,
+         typename StatusRegister,
          uint8_t input_buffer_size_,
          uint8_t output_buffer_size_>
 struct SerialPort {
   typedef TxEnableBit Tx;
   typedef RxEnableBit Rx;
   typedef RxInterruptBit RxInterrupt;
+  typedef TxInterruptBit TxInterrupt;
   typedef TurboBit Turbo;
   enum {
     input_buffer_size = input_buffer_size_,
@@ -82,9 +145,17 @@ struct SerialPort {
   static inline uint8_t tx_ready() { return TxReadyBit::value(); }
   static inline uint8_t rx_ready() { return RxReadyBit::value(); }
   static inline uint8_t data() { return *DataRegister::ptr(); }
+  // Must be read before data().
+  static inline uint8_t status() { return *StatusRegister::ptr(); }
   static inline void set_data(uint8_t value) { *DataRegister::ptr() = value; }
 };
 
+// Filter letting all the received bytes through.
+struct NoRxFilter {
+  static inline uint8_t Timestamp() { return 0; }
+  static inline uint8_t Filter(uint8_t, uint8_t) { return 0; }
+};
+
 template<typename SerialPort>
 struct SerialInput : public Input {
   enum {
@@ -107,14 +178,151 @@ struct SerialInput : public Input {
 
   // Called in data reception interrupt.
   static inline void Received() {
+    Received<NoRxFilter>();
+  }
+
+  // Called in data reception interrupt. Bytes consumed by the filter are not
+  // written to the buffer.
+  template<typename RxFilter>
+  static inline void Received() {
+    uint8_t timestamp = RxFilter::Timestamp();
     if (!readable()) {
        return;
     }
-    // This will discard data if the buffer is full.
-    RingBuffer<SerialInput<SerialPort> >::NonBlockingWrite(ImmediateRead());
+    uint8_t status = SerialPort::status();
+    Value v = ImmediateRead();
+    if (status & (kSerialFramingErrorFlag | kSerialDataOverrunFlag |
+                  kSerialParityErrorFlag)) {
+      CountErrors(status);
+    }
+    if (!RxFilter::Filter(v, timestamp)) {
+      // This will discard data if the buffer is full.
+      if (!RingBuffer<SerialInput<SerialPort> >::NonBlockingWrite(v)) {
+        ++rx_errors_[SERIAL_RX_ERROR_BUFFER_FULL];
+      }
+    }
+  }
+
+  static inline uint16_t rx_errors(SerialRxError error) {
+    uint8_t old_sreg = SREG;
+    cli();
+    uint16_t count = rx_errors_[error];
+    SREG = old_sreg;
+    return count;
   }
+
+  static inline void ResetRxErrors() {
+    uint8_t old_sreg = SREG;
+    cli();
+    for (uint8_t i = 0; i < SERIAL_RX_ERROR_LAST; ++i) {
+      rx_errors_[i] = 0;
+    }
+    SREG = old_sreg;
+  }
+
+ private:
+  static void CountErrors(uint8_t status) {
+    if (status & kSerialFramingErrorFlag) {
+      ++rx_errors_[SERIAL_RX_ERROR_FRAMING];
+    }
+    if (status & kSerialDataOverrunFlag) {
+      ++rx_errors_[SERIAL_RX_ERROR_OVERRUN];
+    }
+    if (status & kSerialParityErrorFlag) {
+      ++rx_errors_[SERIAL_RX_ERROR_PARITY];
+    }
+  }
+
+  static uint16_t rx_errors_[SERIAL_RX_ERROR_LAST];
+};
+
+/* static */
+template<typename SerialPort>
+uint16_t SerialInput<SerialPort>::rx_errors_[SERIAL_RX_ERROR_LAST];
+
+// Filter recording the distribution of the time between two consecutive
+// received bytes, then passing the bytes to Next. The gaps are measured in
+// ticks of GapTimer, a free running Timer<n> which must tick faster than the
+// bytes arrive (a byte lasts 320us at 31250 bauds), and overflow less often
+// than every 2ms - for example an 8-bit timer with a /256 prescaler at 20 MHz
+// (12.8us ticks, 25 ticks per MIDI byte). Bin 0 counts the bytes received
+// during the same tick as the previous one, bin n (0 < n < num_bins - 1) the
+// gaps of 2^(n-1) to 2^n - 1 ticks. The last bin counts the gaps of more than
+// one millisecond (measured with milliseconds()), which the timer cannot
+// resolve. Timestamp() returns the value of GapTimer, and Next receives the
+// same timestamp: a Next filter using its timestamp must use the same timer.
+template<typename GapTimer, typename Next = NoRxFilter>
+class SerialRxGapHistogram {
+ public:
+  enum {
+    num_bins = 10
+  };
+
+  SerialRxGapHistogram() { }
+
+  static inline uint8_t Timestamp() { return GapTimer::value(); }
+
+  static inline uint8_t Filter(uint8_t byte, uint8_t timestamp) {
+    uint8_t ticks = timestamp - last_byte_tick_;
+    uint16_t now = milliseconds();
+    uint16_t elapsed_ms = now - last_byte_time_;
+    last_byte_tick_ = timestamp;
+    last_byte_time_ = now;
+    uint8_t bin = 0;
+    if (elapsed_ms >= 2) {
+      // The timer may have overflowed since the previous byte.
+      bin = num_bins - 1;
+    } else {
+      while (ticks) {
+        ticks >>= 1;
+        ++bin;
+      }
+    }
+    // Saturate instead of wrapping around.
+    if (histogram_[bin] != 0xffff) {
+      ++histogram_[bin];
+    }
+    return Next::Filter(byte, timestamp);
+  }
+
+  static inline uint16_t histogram(uint8_t bin) {
+    uint8_t old_sreg = SREG;
+    cli();
+    uint16_t count = histogram_[bin];
+    SREG = old_sreg;
+    return count;
+  }
+
+  static inline void ResetStatistics() {
+    uint8_t old_sreg = SREG;
+    cli();
+    for (uint8_t i = 0; i < num_bins; ++i) {
+      histogram_[i] = 0;
+    }
+    SREG = old_sreg;
+  }
+
+ private:
+  static uint8_t last_byte_tick_;
+  static uint16_t last_byte_time_;
+  static uint16_t histogram_[num_bins];
+
+  DISALLOW_COPY_AND_ASSIGN(SerialRxGapHistogram);
 };
 
+/* static */
+template<typename GapTimer, typename Next>
+uint8_t SerialRxGapHistogram<GapTimer, Next>::last_byte_tick_;
+
+/* static */
+template<typename GapTimer, typename Next>
+uint16_t SerialRxGapHistogram<GapTimer, Next>::last_byte_time_;
+
+/* static */
+template<typename GapTimer, typename Next>
+uint16_t SerialRxGapHistogram<GapTimer, Next>::histogram_[
+    SerialRxGapHistogram<GapTimer, Next>::num_bins];
+
 template<typename SerialPort>
 struct SerialOutput : public Output {
   enum {
@@ -141,65 +349,135 @@ struct SerialOutput : public Output {
   // No check for ready state.
   static inline void Overwrite(Value v) { SerialPort::set_data(v); }
 
-  // Called in data emission interrupt.
-  static inline Value Requested() {
-    Value v = RingBuffer<SerialOutput<SerialPort> >::NonBlockingRead();
-    if (v >= 0) {
-      Overwrite(v);
+  // Called in data emission interrupt. Disables the interrupt once the buffer
+  // has been drained - it is enabled again by the next write. Can also be
+  // polled.
+  static inline void Requested() {
+    typedef RingBuffer<SerialOutput<SerialPort> > OutputBuffer;
+    if (!writable()) {
+      return;
+    }
+    if (OutputBuffer::readable()) {
+      Overwrite(OutputBuffer::ImmediateRead());
+    } else if (!buffer_sent_) {
+      const uint8_t* data = buffer_data_;
+      Overwrite(buffer_progmem_ ? pgm_read_byte(data) : *data);
+      buffer_data_ = data + 1;
+      if (--buffer_size_ == 0) {
+        buffer_sent_ = 1;
+      }
+    } else {
+      SerialPort::TxInterrupt::clear();
+    }
+  }
+
+  // Queues a buffer to be sent by the data emission interrupt.
+  static inline void SendBuffer(
+      const uint8_t* data,
+      uint16_t size,
+      bool progmem) {
+    while (!buffer_sent_);
+    if (!size) {
+      return;
     }
+    uint8_t old_sreg = SREG;
+    cli();
+    buffer_data_ = data;
+    buffer_size_ = size;
+    buffer_progmem_ = progmem;
+    buffer_sent_ = 0;
+    SREG = old_sreg;
   }
+
+  static inline uint8_t buffer_sent() { return buffer_sent_; }
+
+ private:
+  static const uint8_t* buffer_data_;
+  static uint16_t buffer_size_;
+  static uint8_t buffer_progmem_;
+  static volatile uint8_t buffer_sent_;
 };
 
-template<typename SerialPort, PortMode input = POLLED, PortMode output = POLLED>
-struct SerialImplementation { };
+/* static */
+template<typename SerialPort>
+const uint8_t* SerialOutput<SerialPort>::buffer_data_;
 
+/* static */
 template<typename SerialPort>
-struct SerialImplementation<SerialPort, DISABLED, DISABLED> {
+uint16_t SerialOutput<SerialPort>::buffer_size_;
+
+/* static */
+template<typename SerialPort>
+uint8_t SerialOutput<SerialPort>::buffer_progmem_;
+
+/* static */
+template<typename SerialPort>
+volatile uint8_t SerialOutput<SerialPort>::buffer_sent_ = 1;
+
+template<typename SerialPort, PortMode input = POLLED, PortMode output = POLLED,
+         typename RxFilter = NoRxFilter>
+struct SerialImplementation { };
+
+template<typename SerialPort, typename RxFilter>
+struct SerialImplementation<SerialPort, DISABLED, DISABLED, RxFilter> {
   typedef InputOutput<DisabledInput, DisabledOutput> IO;
 };
-template<typename SerialPort>
-struct SerialImplementation<SerialPort, DISABLED, POLLED> {
+template<typename SerialPort, typename RxFilter>
+struct SerialImplementation<SerialPort, DISABLED, POLLED, RxFilter> {
   typedef InputOutput<DisabledInput, SerialOutput<SerialPort> > IO;
 };
-template<typename SerialPort>
-struct SerialImplementation<SerialPort, DISABLED, BUFFERED> {
+template<typename SerialPort, typename RxFilter>
+struct SerialImplementation<SerialPort, DISABLED, BUFFERED, RxFilter> {
   typedef RingBuffer<SerialOutput<SerialPort> > OutputBuffer;
   typedef InputOutput<DisabledInput, OutputBuffer > IO;
 };
-template<typename SerialPort>
-struct SerialImplementation<SerialPort, POLLED, DISABLED> {
+template<typename SerialPort, typename RxFilter>
+struct SerialImplementation<SerialPort, POLLED, DISABLED, RxFilter> {
   typedef InputOutput<SerialInput<SerialPort>, DisabledOutput> IO;
 };
-template<typename SerialPort>
-struct SerialImplementation<SerialPort, POLLED, POLLED> {
+template<typename SerialPort, typename RxFilter>
+struct SerialImplementation<SerialPort, POLLED, POLLED, RxFilter> {
   typedef InputOutput<SerialInput<SerialPort>, SerialOutput<SerialPort> > IO;
 };
-template<typename SerialPort>
-struct SerialImplementation<SerialPort, POLLED, BUFFERED> {
+template<typename SerialPort, typename RxFilter>
+struct SerialImplementation<SerialPort, POLLED, BUFFERED, RxFilter> {
   typedef RingBuffer<SerialOutput<SerialPort> > OutputBuffer;
   typedef InputOutput<SerialInput<SerialPort>, OutputBuffer> IO;
 };
-template<typename SerialPort>
-struct SerialImplementation<SerialPort, BUFFERED, DISABLED> {
+template<typename SerialPort, typename RxFilter>
+struct SerialImplementation<SerialPort, BUFFERED, DISABLED, RxFilter> {
   typedef RingBuffer<SerialInput<SerialPort> > InputBuffer;
   typedef InputOutput<InputBuffer, DisabledOutput> IO;
+  static inline void Received() {
+    SerialInput<SerialPort>::template Received<RxFilter>();
+  }
 };
-template<typename SerialPort>
-struct SerialImplementation<SerialPort, BUFFERED, POLLED> {
+template<typename SerialPort, typename RxFilter>
+struct SerialImplementation<SerialPort, BUFFERED, POLLED, RxFilter> {
   typedef RingBuffer<SerialInput<SerialPort> > InputBuffer;
   typedef InputOutput<InputBuffer, SerialOutput<SerialPort> > IO;
+  static inline void Received() {
+    SerialInput<SerialPort>::template Received<RxFilter>();
+  }
 };
-template<typename SerialPort>
-struct SerialImplementation<SerialPort, BUFFERED, BUFFERED> {
+template<typename SerialPort, typename RxFilter>
+struct SerialImplementation<SerialPort, BUFFERED, BUFFERED, RxFilter> {
   typedef RingBuffer<SerialInput<SerialPort> > InputBuffer;
   typedef RingBuffer<SerialOutput<SerialPort> > OutputBuffer;
   typedef InputOutput<InputBuffer, OutputBuffer> IO;
+  static inline void Received() {
+    SerialInput<SerialPort>::template Received<RxFilter>();
+  }
 };
+template<typename SerialPort, PortMode input, typename RxFilter>
+struct SerialImplementation<SerialPort, input, INTERRUPT_DRIVEN, RxFilter>
+    : public SerialImplementation<SerialPort, input, BUFFERED, RxFilter> { };
 
 template<typename SerialPort, uint32_t baud_rate, PortMode input = POLLED,
-         PortMode output = POLLED, bool turbo = false>
+         PortMode output = POLLED, bool turbo = false,
+         typename RxFilter = NoRxFilter>
 struct Serial {
-  typedef SerialImplementation<SerialPort, input, output> Impl;
+  typedef SerialImplementation<SerialPort, input, output, RxFilter> Impl;
   typedef uint8_t Value;
   typedef typename Impl::IO::Input Input;
   typedef typename Impl::IO::Output Output;
@@ -232,20 +510,65 @@ struct Serial {
     SerialPort::Tx::clear();
     SerialPort::Rx::clear();
     SerialPort::RxInterrupt::clear();
+    SerialPort::TxInterrupt::clear();
   }
   
-  static inline void Write(Value v) { Impl::IO::Write(v); }
+  static inline void Write(Value v) {
+    Impl::IO::Write(v);
+    StartTransmission();
+  }
   static inline uint8_t writable() { return Impl::IO::writable(); }
   static inline uint8_t NonBlockingWrite(Value v) {
-    return Impl::IO::NonBlockingWrite(v);
+    uint8_t success = Impl::IO::NonBlockingWrite(v);
+    StartTransmission();
+    return success;
+  }
+  static inline void Overwrite(Value v) {
+    Impl::IO::Overwrite(v);
+    StartTransmission();
   }
-  static inline void Overwrite(Value v) { Impl::IO::Overwrite(v); }
   static inline Value Read() { return Impl::IO::Read(); }
   static inline uint8_t readable() { return Impl::IO::readable(); }
   static inline int16_t NonBlockingRead() {
     return Impl::IO::NonBlockingRead();
   }
   static inline Value ImmediateRead() { return Impl::IO::ImmediateRead(); }
+  
+  // To be called from the reception interrupt handler, with buffered input.
+  static inline void Received() { Impl::Received(); }
+  static inline uint16_t rx_errors(SerialRxError error) {
+    return SerialInput<SerialPort>::rx_errors(error);
+  }
+  static inline void ResetRxErrors() {
+    SerialInput<SerialPort>::ResetRxErrors();
+  }
+  
+  // To be called from the data register empty interrupt handler with
+  // interrupt-driven output, or periodically with buffered output.
+  static inline void Requested() { SerialOutput<SerialPort>::Requested(); }
+  
+  // Sends size bytes from data (in flash if progmem is set) with the data
+  // register empty interrupt, without copying them to the output buffer.
+  // Requires interrupt-driven output.
+  static inline void SendBuffer(
+      const uint8_t* data,
+      uint16_t size,
+      bool progmem) {
+    // Nothing would send the buffer, and the next call would wait forever.
+    STATIC_ASSERT(output == INTERRUPT_DRIVEN);
+    SerialOutput<SerialPort>::SendBuffer(data, size, progmem);
+    StartTransmission();
+  }
+  static inline uint8_t buffer_sent() {
+    return SerialOutput<SerialPort>::buffer_sent();
+  }
+  
+ private:
+  static inline void StartTransmission() {
+    if (output == INTERRUPT_DRIVEN) {
+      SerialPort::TxInterrupt::set();
+    }
+  }
 };
 
 
@@ -265,10 +588,12 @@ typedef SerialPort<
     BitInRegister<UCSR0BRegister, RXEN0>,
     BitInRegister<UCSR0ARegister, RXC0>,
     BitInRegister<UCSR0BRegister, RXCIE0>,
+    BitInRegister<UCSR0BRegister, UDRIE0>,
     BitInRegister<UCSR0ARegister, U2X0>,
     UBRR0HRegister,
     UBRR0LRegister,
     UDR0Register,
+    UCSR0ARegister,
     kSerialOutputBufferSize,
     kSerialInputBufferSize> SerialPort0;
 
@@ -291,10 +616,12 @@ typedef SerialPort<
     BitInRegister<UCSR1BRegister, RXEN1>,
     BitInRegister<UCSR1ARegister, RXC1>,
     BitInRegister<UCSR1BRegister, RXCIE1>,
+    BitInRegister<UCSR1BRegister, UDRIE1>,
     BitInRegister<UCSR1ARegister, U2X1>,
     UBRR1HRegister,
     UBRR1LRegister,
     UDR1Register,
+    UCSR1ARegister,
     kSerialOutputBufferSize,
     kSerialInputBufferSize> SerialPort1;
 
@@ -317,10 +644,12 @@ typedef SerialPort<
     BitInRegister<UCSR2BRegister, RXEN2>,
     BitInRegister<UCSR2ARegister, RXC2>,
     BitInRegister<UCSR2BRegister, RXCIE2>,
+    BitInRegister<UCSR2BRegister, UDRIE2>,
     BitInRegister<UCSR2ARegister, U2X2>,
     UBRR2HRegister,
     UBRR2LRegister,
     UDR2Register,
+    UCSR2ARegister,
     kSerialOutputBufferSize,
     kSerialInputBufferSize> SerialPort2;
 
@@ -342,10 +671,12 @@ typedef SerialPort<
     BitInRegister<UCSR3BRegister, RXEN3>,
     BitInRegister<UCSR3ARegister, RXC3>,
     BitInRegister<UCSR3BRegister, RXCIE3>,
+    BitInRegister<UCSR3BRegister, UDRIE3>,
     BitInRegister<UCSR3ARegister, U2X3>,
     UBRR3HRegister,
     UBRR3LRegister,
     UDR3Register,
+    UCSR3ARegister,
     kSerialOutputBufferSize,
     kSerialInputBufferSize> SerialPort3;
 
@@ -51,7 +51,13 @@ class SpiMaster {
     SpiSS::High();
     SlaveSelect::set_mode(DIGITAL_OUTPUT);
     SlaveSelect::High();
-
+    Configure();
+  }
+  
+  // Applies the data order and speed of this master to the SPI peripheral.
+  // To be called before a transfer when the peripheral is shared with devices
+  // using other settings.
+  static inline void Configure() {
     // SPI enabled, configured as master.
     uint8_t configuration = _BV(SPE) | _BV(MSTR);
     if (order == LSB_FIRST) {
@@ -0,0 +1,225 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Benchmark of the BicolorLedArray refresh with pre-packed frames, against the
+// previous refresh code decoding the intensity of each pixel on every scan,
+// for arrays of 1, 2 and 4 shift registers (7, 15 and 31 LEDs), and with the
+// SPI backend (driving the model of SPDR in host/registers.cc). All of them
+// must shift out the same bits.
+//
+// The pins are plain stores to a volatile variable, so the timings (host
+// nanoseconds per refresh) are dominated by the shift out in both cases, and
+// understate the gain on an AVR, where the per-pixel decoding costs about as
+// much as clocking the bit out - and, for the SPI backend, where a byte is
+// shifted out in 16 CPU cycles at fosc/2. The number of pixels decoded per
+// refresh is reported along with them.
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "avrlib/devices/bicolor_led_array.h"
+#include "host_test.h"
+
+using namespace avrlib;
+
+const uint16_t kNumTimedRefreshes = 20000;
+
+// Stands for the PORTx register.
+volatile uint8_t port;
+
+// Bits shifted out, recorded on the rising edges of the clock.
+uint8_t trace[64 * 32];
+uint16_t trace_size;
+
+// Stores to port. When traced is set, the bits are also recorded.
+template<uint8_t bit, bool traced>
+struct FakePin {
+  static void set_mode(uint8_t mode) { }
+  static void High() {
+    port |= 1 << bit;
+    if (traced && bit == 1 && trace_size < sizeof(trace)) {
+      trace[trace_size++] = port & 1;
+    }
+  }
+  static void Low() { port &= ~(1 << bit); }
+  static void set_value(uint8_t value) {
+    if (value) {
+      High();
+    } else {
+      Low();
+    }
+  }
+};
+
+// The refresh code before the frames were pre-packed.
+template<typename Latch, typename Clock, typename Data, uint8_t num_regs>
+struct ReferenceLedArray {
+  enum {
+    size = num_regs * 8 - 1
+  };
+  typedef ShiftRegisterOutput<Latch, Clock, Data, 8, MSB_FIRST> Register;
+
+  static void ShiftOutPixels() {
+    uint8_t threshold = refresh_cycle_ & 0x0f;
+    uint8_t color = refresh_cycle_ & 0x20 ? 1 : 0;
+    uint8_t byte = color;
+    uint8_t num_bits = 1;
+    for (uint8_t i = (num_regs * 8) - 2; i != 0xff ; --i) {
+      byte <<= 1;
+      uint8_t intensity;
+      if (color) {
+        intensity = U8ShiftRight4(~pixels_[i]);
+      } else {
+        intensity = pixels_[i] & 0x0f;
+      }
+      if (intensity > threshold || intensity == 0xf) {
+        byte |= 1;
+      }
+      ++num_bits;
+      if (num_bits == 8) {
+        Register::ShiftOut(byte);
+        num_bits = 0;
+        byte = 0;
+      }
+    }
+    ++refresh_cycle_;
+  }
+
+  static uint8_t pixels_[size];
+  static uint8_t refresh_cycle_;
+};
+
+template<typename Latch, typename Clock, typename Data, uint8_t num_regs>
+uint8_t ReferenceLedArray<Latch, Clock, Data, num_regs>::pixels_[size];
+
+template<typename Latch, typename Clock, typename Data, uint8_t num_regs>
+uint8_t ReferenceLedArray<Latch, Clock, Data, num_regs>::refresh_cycle_;
+
+// Records the bits shifted out by the SPI backend.
+static uint8_t TraceSpiBit(uint8_t bit) {
+  if (trace_size < sizeof(trace)) {
+    trace[trace_size++] = bit;
+  }
+  return 0;
+}
+
+static double Now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+template<uint8_t num_regs, bool traced>
+struct LedArrays {
+  typedef FakePin<0, traced> Data;
+  typedef FakePin<1, traced> Clock;
+  typedef FakePin<2, traced> Latch;
+  typedef BicolorLedArray<Latch, Clock, Data, num_regs> Leds;
+  typedef BicolorLedArray<
+      Latch, Clock, Data, num_regs, SHIFT_REGISTER_SPI> SpiLeds;
+  typedef ReferenceLedArray<Latch, Clock, Data, num_regs> Reference;
+
+  static void Init() {
+    Leds::Init();
+    SpiLeds::Init();
+    srand(42);
+    for (uint8_t i = 0; i < Leds::size; ++i) {
+      uint8_t intensity = rand();
+      Leds::set_pixel(i, intensity);
+      SpiLeds::set_pixel(i, intensity);
+      Reference::pixels_[i] = intensity;
+    }
+    Leds::Sync();
+    SpiLeds::Sync();
+    host_spi_shift = traced ? &TraceSpiBit : NULL;
+  }
+};
+
+template<uint8_t num_regs>
+struct Benchmark {
+  typedef typename LedArrays<num_regs, true>::Leds Leds;
+  typedef typename LedArrays<num_regs, true>::SpiLeds SpiLeds;
+  typedef typename LedArrays<num_regs, true>::Reference Reference;
+  typedef typename LedArrays<num_regs, false>::Leds TimedLeds;
+  typedef typename LedArrays<num_regs, false>::SpiLeds TimedSpiLeds;
+  typedef typename LedArrays<num_regs, false>::Reference TimedReference;
+
+  // Returns 1 if a whole PWM cycle (64 refreshes) is identical.
+  static uint8_t SameOutput() {
+    static uint8_t expected[sizeof(trace)];
+    trace_size = 0;
+    for (uint8_t i = 0; i < 64; ++i) {
+      Reference::ShiftOutPixels();
+    }
+    uint16_t expected_size = trace_size;
+    memcpy(expected, trace, trace_size);
+    trace_size = 0;
+    for (uint8_t i = 0; i < 64; ++i) {
+      Leds::ShiftOutPixels();
+    }
+    if (trace_size != expected_size || memcmp(expected, trace, trace_size)) {
+      return 0;
+    }
+    trace_size = 0;
+    for (uint8_t i = 0; i < 64; ++i) {
+      SpiLeds::ShiftOutPixels();
+    }
+    return trace_size == expected_size &&
+        !memcmp(expected, trace, trace_size);
+  }
+
+  static void Run(const char* name) {
+    LedArrays<num_regs, true>::Init();
+    EXPECT(SameOutput());
+    // set_direct_pixel() patches the frames in place.
+    Leds::set_direct_pixel(3, 0x5a);
+    SpiLeds::set_direct_pixel(3, 0x5a);
+    Reference::pixels_[3] = 0x5a;
+    EXPECT(SameOutput());
+
+    LedArrays<num_regs, false>::Init();
+    double start = Now();
+    for (uint16_t i = 0; i < kNumTimedRefreshes; ++i) {
+      TimedReference::ShiftOutPixels();
+    }
+    double reference_time = (Now() - start) / kNumTimedRefreshes;
+    start = Now();
+    for (uint16_t i = 0; i < kNumTimedRefreshes; ++i) {
+      TimedLeds::ShiftOutPixels();
+    }
+    double packed_time = (Now() - start) / kNumTimedRefreshes;
+    start = Now();
+    for (uint16_t i = 0; i < kNumTimedRefreshes; ++i) {
+      TimedSpiLeds::ShiftOutPixels();
+    }
+    double spi_time = (Now() - start) / kNumTimedRefreshes;
+    printf("%-8s %4d %8d %9d %9.1f %9.1f %9.1f %9.2f\n", name, Leds::size,
+           Leds::size, 0, reference_time, packed_time, spi_time,
+           reference_time / packed_time);
+  }
+};
+
+int main(void) {
+  printf("               pixels decoded     host ns per refresh\n");
+  printf("array    LEDs   before     after    before     after       spi"
+         "   speedup\n");
+  Benchmark<1>::Run("1 x 595");
+  Benchmark<2>::Run("2 x 595");
+  Benchmark<4>::Run("4 x 595");
+  return HostTestResult("bicolor_led_array_test");
+}
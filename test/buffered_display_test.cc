@@ -0,0 +1,227 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// BufferedDisplay driving a mock 40x2 LCD, which counts the bytes written on
+// the bus and keeps a copy of the display RAM. Compares the number of calls
+// to Tick() and of bus writes needed to show an update, with the dirty chunk
+// tracking disabled (line_buffer), enabled (EditLine and CommitLine), and with
+// bursts.
+
+#include <string.h>
+
+#include "avrlib/devices/buffered_display.h"
+#include "host_test.h"
+
+using namespace avrlib;
+
+const uint8_t kWidth = 40;
+const uint8_t kHeight = 2;
+const uint16_t kMaxTicks = 1000;
+
+// The tag gives each display its own LCD.
+template<int tag>
+struct MockLcd {
+  enum {
+    lcd_width = kWidth,
+    lcd_height = kHeight
+  };
+
+  static uint8_t writable() { return 16; }
+  static uint8_t status_counter() { return 0; }
+  static void ResetStatusCounter() { }
+
+  static void MoveCursor(uint8_t row, uint8_t col) {
+    address = row * kWidth + col;
+    ++bus_writes;
+  }
+
+  static uint8_t WriteData(uint8_t c) {
+    ram[address++] = c;
+    ++bus_writes;
+    return 1;
+  }
+
+  static uint8_t ram[kWidth * kHeight];
+  static uint8_t address;
+  static uint16_t bus_writes;
+};
+
+template<int tag> uint8_t MockLcd<tag>::ram[kWidth * kHeight];
+template<int tag> uint8_t MockLcd<tag>::address;
+template<int tag> uint16_t MockLcd<tag>::bus_writes;
+
+struct Cost {
+  uint16_t ticks;
+  uint16_t bus_writes;
+};
+
+template<int tag, uint8_t max_burst>
+struct Bench {
+  typedef MockLcd<tag> Lcd;
+  typedef BufferedDisplay<Lcd, max_burst> Display;
+
+  static char expected[kWidth * kHeight];
+
+  static void Init(uint8_t scan_all) {
+    Display::Init();
+    if (scan_all) {
+      Display::line_buffer(0);
+    }
+    memset(expected, ' ', sizeof(expected));
+    Settle();
+  }
+
+  // Ticks until the LCD shows the expected page.
+  static Cost Settle() {
+    Cost cost;
+    cost.ticks = 0;
+    Lcd::bus_writes = 0;
+    while (memcmp(Lcd::ram, expected, sizeof(expected)) &&
+           cost.ticks < kMaxTicks) {
+      Display::Tick();
+      ++cost.ticks;
+    }
+    cost.bus_writes = Lcd::bus_writes;
+    return cost;
+  }
+
+  static char* Edit(uint8_t line, uint8_t scan_all) {
+    return scan_all ? Display::line_buffer(line) : Display::EditLine(line);
+  }
+
+  static void Commit(uint8_t line, uint8_t scan_all) {
+    if (!scan_all) {
+      Display::CommitLine(line);
+    }
+  }
+
+  // A single character changed at the end of the second line.
+  static Cost SingleCharacter(uint8_t scan_all) {
+    Init(scan_all);
+    Edit(1, scan_all)[30] = expected[kWidth + 30] = '*';
+    Commit(1, scan_all);
+    return Settle();
+  }
+
+  // Both lines rewritten.
+  static Cost FullPage(uint8_t scan_all) {
+    Init(scan_all);
+    for (uint8_t i = 0; i < kWidth * kHeight; ++i) {
+      expected[i] = 'a' + i % 26;
+    }
+    memcpy(Edit(0, scan_all), expected, kWidth);
+    memcpy(Edit(1, scan_all), expected + kWidth, kWidth);
+    Commit(0, scan_all);
+    Commit(1, scan_all);
+    return Settle();
+  }
+};
+
+template<int tag, uint8_t max_burst>
+char Bench<tag, max_burst>::expected[kWidth * kHeight];
+
+typedef Bench<0, 1> ScanAll;
+typedef Bench<1, 1> DirtyChunks;
+typedef Bench<2, 8> DirtyChunksBurst;
+
+static void Print(const char* name, const Cost& single, const Cost& full) {
+  printf("%-20s %12d %12d %12d %12d\n", name, single.ticks, single.bus_writes,
+         full.ticks, full.bus_writes);
+}
+
+// ForceStatus() interrupting the scan of a chunk must not leave the end of
+// the chunk stale.
+static void TestForceStatusMidChunk() {
+  DirtyChunks::Init(0);
+  memcpy(DirtyChunks::Display::EditLine(0) + 16, "abcdefgh", 8);
+  memcpy(DirtyChunks::expected + 16, "abcdefgh", 8);
+  DirtyChunks::Display::CommitLine(0);
+  // The other chunks of the line have not changed: this stops right after
+  // the first character of the third chunk has been sent.
+  while (DirtyChunks::Lcd::ram[16] != 'a') {
+    DirtyChunks::Display::Tick();
+  }
+  DirtyChunks::Display::ForceStatus(1);
+  // The status is shown at both ends of the first line when they are blank.
+  DirtyChunks::expected[0] = DirtyChunks::expected[kWidth - 1] = 1;
+  EXPECT(DirtyChunks::Settle().ticks < kMaxTicks);
+}
+
+// A pointer returned by line_buffer() can be written to at any time.
+static void TestRetainedLineBuffer() {
+  ScanAll::Init(1);
+  char* line = ScanAll::Display::line_buffer(1);
+  for (uint8_t i = 0; i < 100; ++i) {
+    ScanAll::Display::Tick();
+  }
+  line[5] = ScanAll::expected[kWidth + 5] = 'z';
+  EXPECT(ScanAll::Settle().ticks < kMaxTicks);
+  // Back to the dirty chunk tracking: a clean page costs nothing.
+  ScanAll::Display::set_scan_all(0);
+  ScanAll::Settle();
+  uint16_t bus_writes = ScanAll::Lcd::bus_writes;
+  for (uint8_t i = 0; i < 100; ++i) {
+    ScanAll::Display::Tick();
+  }
+  EXPECT_EQ(bus_writes, ScanAll::Lcd::bus_writes);
+}
+
+// Tick() interrupting the writes between EditLine() and CommitLine() must not
+// leave the characters written after its scan stale.
+static void TestTickDuringEdit() {
+  DirtyChunks::Init(0);
+  char* line = DirtyChunks::Display::EditLine(1);
+  line[2] = DirtyChunks::expected[kWidth + 2] = 'x';
+  for (uint8_t i = 0; i < 100; ++i) {
+    DirtyChunks::Display::Tick();
+  }
+  line[3] = DirtyChunks::expected[kWidth + 3] = 'y';
+  DirtyChunks::Display::CommitLine(1);
+  EXPECT(DirtyChunks::Settle().ticks < kMaxTicks);
+}
+
+int main(void) {
+  printf("                       single character          full page\n");
+  printf("mode                        ticks   bus writes        ticks"
+         "   bus writes\n");
+  Cost scan_all_single = ScanAll::SingleCharacter(1);
+  Cost scan_all_full = ScanAll::FullPage(1);
+  Cost dirty_single = DirtyChunks::SingleCharacter(0);
+  Cost dirty_full = DirtyChunks::FullPage(0);
+  Cost burst_single = DirtyChunksBurst::SingleCharacter(0);
+  Cost burst_full = DirtyChunksBurst::FullPage(0);
+  Print("scan all", scan_all_single, scan_all_full);
+  Print("dirty chunks", dirty_single, dirty_full);
+  Print("dirty chunks, burst", burst_single, burst_full);
+
+  EXPECT(scan_all_full.ticks < kMaxTicks);
+  EXPECT(dirty_full.ticks < kMaxTicks);
+  EXPECT(burst_full.ticks < kMaxTicks);
+  // Only the edited line is scanned.
+  EXPECT(dirty_single.ticks <= kWidth);
+  EXPECT(dirty_single.ticks < scan_all_single.ticks);
+  EXPECT_EQ(2, dirty_single.bus_writes);
+  // One cursor move per line, and at most one per burst.
+  EXPECT_EQ(kWidth * kHeight + kHeight, dirty_full.bus_writes);
+  EXPECT(burst_full.bus_writes <= dirty_full.bus_writes);
+  EXPECT(burst_full.ticks <= (kWidth * kHeight + 7) / 8);
+
+  TestTickDuringEdit();
+  TestForceStatusMidChunk();
+  TestRetainedLineBuffer();
+  return HostTestResult("buffered_display_test");
+}
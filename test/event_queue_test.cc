@@ -0,0 +1,181 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Coalescing of the pot and encoder events by EventQueue: an event still
+// waiting in the queue is updated in place, an event already pulled is not,
+// and the index of the pending events survives the wraparound of the buffer.
+// Timestamps and latency histogram, with the time set by hand.
+
+#include "avrlib/ui/event_queue.h"
+#include "host_test.h"
+
+using namespace avrlib;
+
+typedef EventQueue<8, EVENT_FORMAT_COMPACT, 4> Queue;
+typedef EventQueue<8, EVENT_FORMAT_WIDE, 4> WideQueue;
+typedef EventQueue<8, EVENT_FORMAT_COMPACT, 4, true> TimestampedQueue;
+
+static void SetTime(uint32_t ms) {
+  timer0_milliseconds.value = ms;
+}
+
+static void TestCoalescePendingPot() {
+  Queue::Flush();
+  Queue::AddEvent(CONTROL_POT, 1, 10);
+  Queue::AddEvent(CONTROL_POT, 2, 50);
+  Queue::AddEvent(CONTROL_POT, 1, 20);
+  EXPECT_EQ(2, Queue::available());
+  Event event = Queue::PullEvent();
+  EXPECT_EQ(CONTROL_POT, event.control_type);
+  EXPECT_EQ(1, event.control_id);
+  EXPECT_EQ(20, event.value);
+  EXPECT_EQ(50, Queue::PullEvent().value);
+}
+
+static void TestCoalescePendingEncoder() {
+  Queue::Flush();
+  Queue::AddEvent(CONTROL_ENCODER, 2, 1);
+  Queue::AddEvent(CONTROL_ENCODER, 2, 1);
+  Queue::AddEvent(CONTROL_ENCODER, 2, static_cast<uint8_t>(-1));
+  Queue::AddEvent(CONTROL_ENCODER, 2, 3);
+  EXPECT_EQ(1, Queue::available());
+  EXPECT_EQ(4, Queue::PullEvent().value);
+  // The increments saturate.
+  Queue::AddEvent(CONTROL_ENCODER, 2, 100);
+  Queue::AddEvent(CONTROL_ENCODER, 2, 100);
+  EXPECT_EQ(127, Queue::PullEvent().value);
+  Queue::AddEvent(CONTROL_ENCODER, 2, static_cast<uint8_t>(-100));
+  Queue::AddEvent(CONTROL_ENCODER, 2, static_cast<uint8_t>(-100));
+  EXPECT_EQ(static_cast<uint8_t>(-128), Queue::PullEvent().value);
+
+  WideQueue::Flush();
+  WideQueue::AddEvent(CONTROL_ENCODER, 3, 30000);
+  WideQueue::AddEvent(CONTROL_ENCODER, 3, 30000);
+  EXPECT_EQ(1, WideQueue::available());
+  EXPECT_EQ(32767, WideQueue::PullEvent().value);
+}
+
+static void TestNoCoalescing() {
+  Queue::Flush();
+  // Another type of control with the same id.
+  Queue::AddEvent(CONTROL_POT, 1, 10);
+  Queue::AddEvent(CONTROL_ENCODER, 1, 1);
+  Queue::AddEvent(CONTROL_POT, 1, 20);
+  EXPECT_EQ(3, Queue::available());
+  // Switches, and ids beyond num_coalesced_ids.
+  Queue::Flush();
+  Queue::AddEvent(CONTROL_SWITCH, 1, 1);
+  Queue::AddEvent(CONTROL_SWITCH, 1, 0);
+  Queue::AddEvent(CONTROL_POT, 5, 10);
+  Queue::AddEvent(CONTROL_POT, 5, 20);
+  EXPECT_EQ(4, Queue::available());
+}
+
+static void TestNoCoalescingAfterRead() {
+  Queue::Flush();
+  Queue::AddEvent(CONTROL_POT, 1, 10);
+  EXPECT_EQ(10, Queue::PullEvent().value);
+  // The slot still holds the event of pot 1, but it has been consumed.
+  Queue::AddEvent(CONTROL_POT, 1, 20);
+  EXPECT_EQ(1, Queue::available());
+  EXPECT_EQ(20, Queue::PullEvent().value);
+
+  Queue::AddEvent(CONTROL_POT, 1, 30);
+  Queue::AddEvent(CONTROL_POT, 0, 40);
+  EXPECT_EQ(30, Queue::PullEvent().value);
+  Queue::AddEvent(CONTROL_POT, 1, 50);
+  EXPECT_EQ(2, Queue::available());
+  EXPECT_EQ(40, Queue::PullEvent().value);
+  EXPECT_EQ(50, Queue::PullEvent().value);
+}
+
+static void TestWraparound() {
+  Queue::Flush();
+  // Keeps 3 events in the queue while the pointers go around the buffer
+  // several times, with the coalesced event on each side of the wrap.
+  Queue::AddEvent(CONTROL_SWITCH, 0, 0);
+  Queue::AddEvent(CONTROL_SWITCH, 0, 0);
+  for (uint8_t i = 0; i < 40; ++i) {
+    Queue::AddEvent(CONTROL_POT, 3, i);
+    Queue::AddEvent(CONTROL_SWITCH, 0, i);
+    Queue::AddEvent(CONTROL_POT, 3, i + 100);
+    EXPECT_EQ(4, Queue::available());
+    Queue::PullEvent();
+    Queue::PullEvent();
+    EXPECT_EQ(2, Queue::available());
+    Event event = Queue::PullEvent();
+    EXPECT_EQ(CONTROL_POT, event.control_type);
+    EXPECT_EQ(i + 100, event.value);
+    Queue::AddEvent(CONTROL_SWITCH, 0, i);
+  }
+}
+
+static void TestLatency() {
+  TimestampedQueue::Flush();
+  TimestampedQueue::ResetLatencyStatistics();
+  SetTime(1000);
+  TimestampedQueue::AddEvent(CONTROL_SWITCH, 0, 1);
+  SetTime(1003);
+  TimestampedQueue::AddEvent(CONTROL_SWITCH, 1, 1);
+  TimestampedQueue::PullEvent();
+  EXPECT_EQ(3, TimestampedQueue::last_latency());
+  TimestampedQueue::PullEvent();
+  EXPECT_EQ(0, TimestampedQueue::last_latency());
+
+  // A coalesced event keeps the time of its oldest change.
+  SetTime(2000);
+  TimestampedQueue::AddEvent(CONTROL_POT, 2, 10);
+  SetTime(2004);
+  TimestampedQueue::AddEvent(CONTROL_POT, 2, 20);
+  SetTime(2005);
+  EXPECT_EQ(20, TimestampedQueue::PullEvent().value);
+  EXPECT_EQ(5, TimestampedQueue::last_latency());
+
+  // Long latencies go to the last bin, across the wraparound of the 16 bits
+  // timestamps.
+  SetTime(65530);
+  TimestampedQueue::AddEvent(CONTROL_SWITCH, 0, 0);
+  SetTime(65536 + 70);
+  TimestampedQueue::PullEvent();
+  EXPECT_EQ(76, TimestampedQueue::last_latency());
+  EXPECT_EQ(76, TimestampedQueue::max_latency());
+
+  EXPECT_EQ(1, TimestampedQueue::latency_histogram(0));
+  EXPECT_EQ(1, TimestampedQueue::latency_histogram(3));
+  EXPECT_EQ(1, TimestampedQueue::latency_histogram(5));
+  EXPECT_EQ(1, TimestampedQueue::latency_histogram(
+      TimestampedQueue::num_latency_bins - 1));
+  uint16_t total = 0;
+  for (uint8_t i = 0; i < TimestampedQueue::num_latency_bins; ++i) {
+    total += TimestampedQueue::latency_histogram(i);
+  }
+  EXPECT_EQ(4, total);
+
+  TimestampedQueue::ResetLatencyStatistics();
+  EXPECT_EQ(0, TimestampedQueue::max_latency());
+  EXPECT_EQ(0, TimestampedQueue::latency_histogram(3));
+}
+
+int main(void) {
+  TestCoalescePendingPot();
+  TestCoalescePendingEncoder();
+  TestNoCoalescing();
+  TestNoCoalescingAfterRead();
+  TestWraparound();
+  TestLatency();
+  return HostTestResult("event_queue_test");
+}
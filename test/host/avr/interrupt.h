@@ -0,0 +1,29 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Host replacement for <avr/interrupt.h>.
+
+#ifndef AVRLIB_TEST_HOST_AVR_INTERRUPT_H_
+#define AVRLIB_TEST_HOST_AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+
+#define cli()
+#define sei()
+#define ISR(vector) extern "C" void vector(void)
+
+#endif  // AVRLIB_TEST_HOST_AVR_INTERRUPT_H_
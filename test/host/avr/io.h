@@ -0,0 +1,181 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Host replacement for <avr/io.h>: the I/O registers are plain variables, so
+// that the drivers can be compiled and exercised by the host tests. The
+// variables are defined in registers.cc.
+
+#ifndef AVRLIB_TEST_HOST_AVR_IO_H_
+#define AVRLIB_TEST_HOST_AVR_IO_H_
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+#define _SFR_BYTE(reg) (*(volatile uint8_t*)&(reg))
+#define _SFR_WORD(reg) (*(volatile uint16_t*)&(reg))
+
+#ifdef HOST_DEFINE_REGISTERS
+#define HOST_REGISTER(type, name) volatile type name;
+#else
+#define HOST_REGISTER(type, name) extern volatile type name;
+#endif  // HOST_DEFINE_REGISTERS
+
+HOST_REGISTER(uint8_t, SREG)
+HOST_REGISTER(uint8_t, ADCSRA)
+HOST_REGISTER(uint8_t, ADMUX)
+HOST_REGISTER(uint8_t, ADCL)
+HOST_REGISTER(uint8_t, ADCH)
+HOST_REGISTER(uint8_t, ADCSRB)
+HOST_REGISTER(uint8_t, DDRA)
+HOST_REGISTER(uint8_t, DDRB)
+HOST_REGISTER(uint8_t, DDRC)
+HOST_REGISTER(uint8_t, DDRD)
+HOST_REGISTER(uint8_t, PORTA)
+HOST_REGISTER(uint8_t, PORTB)
+HOST_REGISTER(uint8_t, PORTC)
+HOST_REGISTER(uint8_t, PORTD)
+HOST_REGISTER(uint8_t, PINA)
+HOST_REGISTER(uint8_t, PINB)
+HOST_REGISTER(uint8_t, PINC)
+HOST_REGISTER(uint8_t, PIND)
+HOST_REGISTER(uint8_t, TCCR0A)
+HOST_REGISTER(uint8_t, TCCR0B)
+HOST_REGISTER(uint8_t, TCCR1A)
+HOST_REGISTER(uint8_t, TCCR1B)
+HOST_REGISTER(uint8_t, TCCR2A)
+HOST_REGISTER(uint8_t, TCCR2B)
+HOST_REGISTER(uint8_t, TCCR3A)
+HOST_REGISTER(uint8_t, TCCR3B)
+HOST_REGISTER(uint8_t, TIMSK0)
+HOST_REGISTER(uint8_t, TIMSK1)
+HOST_REGISTER(uint8_t, TIMSK2)
+HOST_REGISTER(uint8_t, TIMSK3)
+HOST_REGISTER(uint8_t, TCNT0)
+HOST_REGISTER(uint16_t, TCNT1)
+HOST_REGISTER(uint8_t, TCNT2)
+HOST_REGISTER(uint16_t, TCNT3)
+HOST_REGISTER(uint8_t, OCR0A)
+HOST_REGISTER(uint8_t, OCR0B)
+HOST_REGISTER(uint16_t, OCR1A)
+HOST_REGISTER(uint16_t, OCR1B)
+HOST_REGISTER(uint8_t, OCR2A)
+HOST_REGISTER(uint8_t, OCR2B)
+HOST_REGISTER(uint16_t, OCR3A)
+HOST_REGISTER(uint16_t, OCR3B)
+HOST_REGISTER(uint8_t, TIFR0)
+HOST_REGISTER(uint8_t, TIFR1)
+HOST_REGISTER(uint8_t, TIFR2)
+HOST_REGISTER(uint8_t, TIFR3)
+HOST_REGISTER(uint8_t, SPCR)
+HOST_REGISTER(uint8_t, SPSR)
+HOST_REGISTER(uint8_t, UBRR0H)
+HOST_REGISTER(uint8_t, UBRR0L)
+HOST_REGISTER(uint16_t, UBRR0)
+HOST_REGISTER(uint8_t, UCSR0A)
+HOST_REGISTER(uint8_t, UCSR0B)
+HOST_REGISTER(uint8_t, UCSR0C)
+HOST_REGISTER(uint8_t, UDR0)
+HOST_REGISTER(uint8_t, UBRR1H)
+HOST_REGISTER(uint8_t, UBRR1L)
+HOST_REGISTER(uint16_t, UBRR1)
+HOST_REGISTER(uint8_t, UCSR1A)
+HOST_REGISTER(uint8_t, UCSR1B)
+HOST_REGISTER(uint8_t, UCSR1C)
+HOST_REGISTER(uint8_t, UDR1)
+HOST_REGISTER(uint8_t, PCICR)
+HOST_REGISTER(uint8_t, PCIFR)
+HOST_REGISTER(uint8_t, PCMSK0)
+HOST_REGISTER(uint8_t, PCMSK1)
+HOST_REGISTER(uint8_t, PCMSK2)
+HOST_REGISTER(uint8_t, PCMSK3)
+HOST_REGISTER(uint8_t, TWBR)
+HOST_REGISTER(uint8_t, TWSR)
+HOST_REGISTER(uint8_t, TWCR)
+HOST_REGISTER(uint8_t, TWDR)
+HOST_REGISTER(uint8_t, TWAR)
+HOST_REGISTER(uint8_t, MCUSR)
+HOST_REGISTER(uint8_t, WDTCSR)
+HOST_REGISTER(uint8_t, EECR)
+HOST_REGISTER(uint8_t, EEDR)
+HOST_REGISTER(uint16_t, EEAR)
+
+// SPI data register. Writing a byte performs the whole transfer at once: the
+// 8 bits are shifted out (in the order set by DORD in SPCR) through
+// host_spi_shift, which returns the bit shifted in, and SPIF is set.
+struct HostSpiDataRegister {
+  HostSpiDataRegister& operator=(uint8_t byte);
+  operator uint8_t() const { return value; }
+  uint8_t value;
+};
+
+extern HostSpiDataRegister SPDR;
+extern uint8_t (*host_spi_shift)(uint8_t bit);
+
+#define ADSC 6
+#define ADEN 7
+#define SPI2X 0
+#define SPIF 7
+#define SPE 6
+#define MSTR 4
+#define DORD 5
+#define SPR0 0
+#define SPR1 1
+#define SPIE 7
+#define TXEN0 3
+#define RXEN0 4
+#define RXCIE0 7
+#define UDRIE0 5
+#define TXCIE0 6
+#define UDRE0 5
+#define RXC0 7
+#define TXC0 6
+#define FE0 4
+#define DOR0 3
+#define UPE0 2
+#define U2X0 1
+#define UMSEL01 7
+#define UMSEL00 6
+#define TXEN1 3
+#define RXEN1 4
+#define RXCIE1 7
+#define UDRIE1 5
+#define UDRE1 5
+#define RXC1 7
+#define FE1 4
+#define DOR1 3
+#define UPE1 2
+#define U2X1 1
+#define UMSEL11 7
+#define UMSEL10 6
+#define COM0A1 7
+#define COM0B1 5
+#define COM1A1 7
+#define COM1B1 5
+#define COM2A1 7
+#define COM2B1 5
+#define WGM01 1
+#define WGM12 3
+#define WGM21 1
+#define OCIE0A 1
+#define OCIE1A 1
+#define OCIE2A 1
+#define PCIE0 0
+#define PCIE1 1
+#define PCIE2 2
+#define PCIE3 3
+
+#endif  // AVRLIB_TEST_HOST_AVR_IO_H_
@@ -0,0 +1,52 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Minimal assertion helpers for the host tests.
+
+#ifndef AVRLIB_TEST_HOST_HOST_TEST_H_
+#define AVRLIB_TEST_HOST_HOST_TEST_H_
+
+#include <stdio.h>
+
+static int host_test_failures = 0;
+
+#define EXPECT(condition) \
+  do { \
+    if (!(condition)) { \
+      printf("%s:%d: expectation failed: %s\n", __FILE__, __LINE__, \
+             #condition); \
+      ++host_test_failures; \
+    } \
+  } while (0)
+
+#define EXPECT_EQ(expected, actual) \
+  do { \
+    long e = (expected); \
+    long a = (actual); \
+    if (e != a) { \
+      printf("%s:%d: expected %s == %ld, got %ld\n", __FILE__, __LINE__, \
+             #actual, e, a); \
+      ++host_test_failures; \
+    } \
+  } while (0)
+
+static inline int HostTestResult(const char* name) {
+  printf("%s: %s\n", name, host_test_failures ? "FAILED" : "PASSED");
+  return host_test_failures ? 1 : 0;
+}
+
+#endif  // AVRLIB_TEST_HOST_HOST_TEST_H_
@@ -0,0 +1,43 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Storage for the I/O registers of the host build, and model of the SPI data
+// register.
+
+#define HOST_DEFINE_REGISTERS
+
+#include <avr/io.h>
+
+HostSpiDataRegister SPDR;
+uint8_t (*host_spi_shift)(uint8_t bit);
+
+HostSpiDataRegister& HostSpiDataRegister::operator=(uint8_t byte) {
+  uint8_t received = 0;
+  for (uint8_t i = 0; i < 8; ++i) {
+    uint8_t bit;
+    if (SPCR & _BV(DORD)) {
+      bit = host_spi_shift ? host_spi_shift((byte >> i) & 1) : 1;
+      received |= bit << i;
+    } else {
+      bit = host_spi_shift ? host_spi_shift((byte >> (7 - i)) & 1) : 1;
+      received |= bit << (7 - i);
+    }
+  }
+  value = received;
+  SPSR |= _BV(SPIF);
+  return *this;
+}
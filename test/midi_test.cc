@@ -0,0 +1,332 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Tests of MidiStreamParser (running status, real-time bytes inside messages
+// and sysex, sysex chunking, note on with a null velocity) and of
+// MidiRealTimeRxFilter, and benchmark on a dense synthetic stream: messages per
+// second and host nanoseconds per byte.
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "avrlib/midi/midi.h"
+#include "avrlib/serial.h"
+#include "host_test.h"
+
+using namespace avrlib;
+
+const uint8_t kChunkSize = 16;
+const uint16_t kStreamSize = 60000;
+const uint8_t kNumBenchmarkPasses = 20;
+
+enum MessageType {
+  NOTE_ON,
+  NOTE_OFF,
+  CONTROL_CHANGE,
+  PITCH_BEND,
+  PROGRAM_CHANGE,
+  CLOCK,
+  SYSEX_START,
+  SYSEX_DATA,
+  SYSEX_END
+};
+
+struct Message {
+  uint8_t type;
+  uint8_t channel;
+  uint16_t a;
+  uint8_t b;
+};
+
+Message messages[64];
+uint8_t num_messages;
+uint32_t num_dispatched;
+
+static void Log(uint8_t type, uint8_t channel, uint16_t a, uint8_t b) {
+  ++num_dispatched;
+  if (num_messages < 64) {
+    Message m = { type, channel, a, b };
+    messages[num_messages++] = m;
+  }
+}
+
+struct Recorder : public MidiHandler {
+  static void NoteOn(uint8_t channel, uint8_t note, uint8_t velocity) {
+    Log(NOTE_ON, channel, note, velocity);
+  }
+  static void NoteOff(uint8_t channel, uint8_t note, uint8_t velocity) {
+    Log(NOTE_OFF, channel, note, velocity);
+  }
+  static void ControlChange(uint8_t channel, uint8_t controller,
+                            uint8_t value) {
+    Log(CONTROL_CHANGE, channel, controller, value);
+  }
+  static void ProgramChange(uint8_t channel, uint8_t program) {
+    Log(PROGRAM_CHANGE, channel, program, 0);
+  }
+  static void PitchBend(uint8_t channel, uint16_t value) {
+    Log(PITCH_BEND, channel, value, 0);
+  }
+  static void Clock() { Log(CLOCK, 0, 0, 0); }
+  static void SysExStart() { Log(SYSEX_START, 0, 0, 0); }
+  static void SysExData(const uint8_t* data, uint8_t size) {
+    Log(SYSEX_DATA, 0, size, data[0]);
+  }
+  static void SysExEnd() { Log(SYSEX_END, 0, 0, 0); }
+};
+
+typedef MidiStreamParser<Recorder, kChunkSize> Parser;
+
+// Serves a byte array as an input buffer.
+struct ArrayInput {
+  static uint8_t readable() {
+    uint16_t left = size - position;
+    return left > 255 ? 255 : left;
+  }
+  static uint8_t ImmediateRead() { return data[position++]; }
+
+  static const uint8_t* data;
+  static uint16_t size;
+  static uint16_t position;
+};
+
+const uint8_t* ArrayInput::data;
+uint16_t ArrayInput::size;
+uint16_t ArrayInput::position;
+
+static void Parse(const uint8_t* data, uint16_t size) {
+  Parser::Init();
+  num_messages = 0;
+  ArrayInput::data = data;
+  ArrayInput::size = size;
+  ArrayInput::position = 0;
+  while (Parser::ProcessInput<ArrayInput>()) { }
+}
+
+#define EXPECT_MESSAGE(index, type_, channel_, a_, b_) \
+  do { \
+    EXPECT_EQ(type_, messages[index].type); \
+    EXPECT_EQ(channel_, messages[index].channel); \
+    EXPECT_EQ(a_, messages[index].a); \
+    EXPECT_EQ(b_, messages[index].b); \
+  } while (0)
+
+static void TestRunningStatus() {
+  const uint8_t stream[] = {
+    0x92, 60, 100, 64, 90,  // 2 notes on with running status.
+    0xb1, 7, 127, 10, 64,  // 2 control changes.
+    0xe0, 0x00, 0x40  // Pitch bend, centered.
+  };
+  Parse(stream, sizeof(stream));
+  EXPECT_EQ(5, num_messages);
+  EXPECT_MESSAGE(0, NOTE_ON, 2, 60, 100);
+  EXPECT_MESSAGE(1, NOTE_ON, 2, 64, 90);
+  EXPECT_MESSAGE(2, CONTROL_CHANGE, 1, 7, 127);
+  EXPECT_MESSAGE(3, CONTROL_CHANGE, 1, 10, 64);
+  EXPECT_MESSAGE(4, PITCH_BEND, 0, 8192, 0);
+}
+
+static void TestNoteOnNullVelocity() {
+  const uint8_t stream[] = { 0x90, 60, 100, 60, 0, 0x80, 62, 30 };
+  Parse(stream, sizeof(stream));
+  EXPECT_EQ(3, num_messages);
+  EXPECT_MESSAGE(0, NOTE_ON, 0, 60, 100);
+  EXPECT_MESSAGE(1, NOTE_OFF, 0, 60, 0);
+  EXPECT_MESSAGE(2, NOTE_OFF, 0, 62, 30);
+}
+
+static void TestRealTimeInsideMessages() {
+  const uint8_t stream[] = {
+    0x90, 0xf8, 60, 0xf8, 100,  // Clocks between the data bytes.
+    62, 0xf8, 110,  // Running status is kept.
+    0xc3, 0xf8, 5
+  };
+  Parse(stream, sizeof(stream));
+  EXPECT_EQ(7, num_messages);
+  EXPECT_MESSAGE(0, CLOCK, 0, 0, 0);
+  EXPECT_MESSAGE(1, CLOCK, 0, 0, 0);
+  EXPECT_MESSAGE(2, NOTE_ON, 0, 60, 100);
+  EXPECT_MESSAGE(3, CLOCK, 0, 0, 0);
+  EXPECT_MESSAGE(4, NOTE_ON, 0, 62, 110);
+  EXPECT_MESSAGE(5, CLOCK, 0, 0, 0);
+  EXPECT_MESSAGE(6, PROGRAM_CHANGE, 3, 5, 0);
+}
+
+static void TestRealTimeInsideSysEx() {
+  const uint8_t stream[] = { 0xf0, 1, 2, 0xf8, 3, 0xf7 };
+  Parse(stream, sizeof(stream));
+  EXPECT_EQ(4, num_messages);
+  EXPECT_MESSAGE(0, SYSEX_START, 0, 0, 0);
+  EXPECT_MESSAGE(1, CLOCK, 0, 0, 0);
+  // The clock does not split the payload.
+  EXPECT_MESSAGE(2, SYSEX_DATA, 0, 3, 1);
+  EXPECT_MESSAGE(3, SYSEX_END, 0, 0, 0);
+}
+
+static void TestSysExChunks() {
+  uint8_t stream[42];
+  stream[0] = 0xf0;
+  for (uint8_t i = 0; i < 40; ++i) {
+    stream[i + 1] = i;
+  }
+  stream[41] = 0x90;  // Ends the sysex without 0xf7.
+  Parse(stream, sizeof(stream));
+  EXPECT_EQ(5, num_messages);
+  EXPECT_MESSAGE(0, SYSEX_START, 0, 0, 0);
+  EXPECT_MESSAGE(1, SYSEX_DATA, 0, kChunkSize, 0);
+  EXPECT_MESSAGE(2, SYSEX_DATA, 0, kChunkSize, kChunkSize);
+  EXPECT_MESSAGE(3, SYSEX_DATA, 0, 40 - 2 * kChunkSize, 2 * kChunkSize);
+  EXPECT_MESSAGE(4, SYSEX_END, 0, 0, 0);
+}
+
+static void TestMaxSize() {
+  const uint8_t stream[] = { 0x90, 60, 100, 62, 100 };
+  Parser::Init();
+  num_messages = 0;
+  ArrayInput::data = stream;
+  ArrayInput::size = sizeof(stream);
+  ArrayInput::position = 0;
+  EXPECT_EQ(3, Parser::ProcessInput<ArrayInput>(3));
+  EXPECT_EQ(1, num_messages);
+  EXPECT_EQ(2, Parser::ProcessInput<ArrayInput>(3));
+  EXPECT_EQ(2, num_messages);
+}
+
+// Free running timer, advanced by hand.
+struct FakeTimer {
+  static uint8_t value() { return ticks; }
+  static uint8_t ticks;
+};
+
+uint8_t FakeTimer::ticks;
+
+typedef MidiRealTimeRxFilter<Parser, FakeTimer> RealTimeFilter;
+typedef Serial<SerialPort0, 31250, BUFFERED, POLLED, false,
+               RealTimeFilter> MidiSerial;
+
+static void Receive(uint8_t byte) {
+  UCSR0A = _BV(RXC0);
+  UDR0 = byte;
+  MidiSerial::Received();
+  UCSR0A = 0;
+}
+
+static void TestRealTimeRxFilter() {
+  MidiSerial::Init();
+  Parser::Init();
+  num_messages = 0;
+  Receive(0x90);
+  Receive(kMidiClock);
+  Receive(60);
+  // Only the clock is dispatched from the interrupt.
+  EXPECT_EQ(1, num_messages);
+  EXPECT_MESSAGE(0, CLOCK, 0, 0, 0);
+  EXPECT_EQ(2, MidiSerial::readable());
+  EXPECT_EQ(0x90, MidiSerial::ImmediateRead());
+  EXPECT_EQ(60, MidiSerial::ImmediateRead());
+
+  // The latency is counted from the timestamp taken on entry in the interrupt.
+  FakeTimer::ticks = 250;
+  uint8_t timestamp = RealTimeFilter::Timestamp();
+  FakeTimer::ticks = 4;
+  EXPECT_EQ(1, RealTimeFilter::Filter(kMidiClock, timestamp));
+  EXPECT_EQ(10, RealTimeFilter::last_latency());
+  EXPECT_EQ(10, RealTimeFilter::max_latency());
+  EXPECT_EQ(0, RealTimeFilter::Filter(0x80, timestamp));
+  EXPECT_EQ(2, num_messages);
+}
+
+// Dense stream: notes with running status, control changes and pitch bends
+// on several channels, a clock every 24 bytes, and a few sysex.
+static uint16_t MakeStream(uint8_t* stream, uint32_t* num_messages) {
+  uint16_t size = 0;
+  uint8_t status = 0;
+  *num_messages = 0;
+  srand(42);
+  while (size < kStreamSize - 64) {
+    uint8_t r = rand() % 100;
+    uint8_t channel = rand() % 4;
+    uint8_t new_status;
+    uint8_t num_data_bytes = 2;
+    if (r < 2) {
+      stream[size++] = 0xf0;
+      for (uint8_t i = 0; i < 40; ++i) {
+        stream[size++] = rand() & 0x7f;
+      }
+      stream[size++] = 0xf7;
+      status = 0;
+      *num_messages += 1 + 3 + 1;
+      continue;
+    } else if (r < 60) {
+      new_status = 0x90 | channel;
+    } else if (r < 85) {
+      new_status = 0xb0 | channel;
+    } else {
+      new_status = 0xe0 | channel;
+    }
+    if (new_status != status) {
+      stream[size++] = new_status;
+      status = new_status;
+    }
+    for (uint8_t i = 0; i < num_data_bytes; ++i) {
+      stream[size++] = rand() & 0x7f;
+      if (size % 24 == 0) {
+        stream[size++] = 0xf8;
+        ++*num_messages;
+      }
+    }
+    ++*num_messages;
+  }
+  return size;
+}
+
+static double Now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static void Benchmark() {
+  static uint8_t stream[kStreamSize];
+  uint32_t expected_messages;
+  uint16_t size = MakeStream(stream, &expected_messages);
+  num_dispatched = 0;
+  double start = Now();
+  for (uint8_t i = 0; i < kNumBenchmarkPasses; ++i) {
+    Parse(stream, size);
+  }
+  double elapsed = Now() - start;
+  EXPECT_EQ(expected_messages * kNumBenchmarkPasses, num_dispatched);
+  // For reference, a byte arrives every 320us at 31250 bauds.
+  printf("%d bytes, %u messages: %.1f host ns/byte, %.2f M messages/s\n",
+         size, static_cast<unsigned>(expected_messages),
+         elapsed / (size * kNumBenchmarkPasses),
+         num_dispatched / elapsed * 1e3);
+}
+
+int main(void) {
+  TestRunningStatus();
+  TestNoteOnNullVelocity();
+  TestRealTimeInsideMessages();
+  TestRealTimeInsideSysEx();
+  TestSysExChunks();
+  TestMaxSize();
+  TestRealTimeRxFilter();
+  Benchmark();
+  return HostTestResult("midi_test");
+}
@@ -0,0 +1,91 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Debouncing of PinChangeSwitch: changes during the lockout are ignored, then
+// reported by Poll(), and the lockout does not come back every 256 ms.
+
+#include "avrlib/devices/pin_change_input.h"
+#include "host_test.h"
+
+using namespace avrlib;
+
+struct FakeInput {
+  static void set_mode(uint8_t mode) { }
+  static void High() { }
+  static uint8_t value() { return level; }
+  static uint8_t level;
+};
+
+uint8_t FakeInput::level;
+
+typedef PinChangeSwitch<FakeInput, 0, 5> Switch;
+typedef EventQueue<16> Queue;
+
+static void SetTime(uint32_t ms) {
+  timer0_milliseconds.value = ms;
+}
+
+// Changes the input and runs the ISR. Returns the number of events queued.
+static uint8_t Change(uint8_t level) {
+  FakeInput::level = level;
+  uint8_t before = Queue::available();
+  Switch::OnPinChange<Queue>(3);
+  return Queue::available() - before;
+}
+
+static void TestLockout() {
+  SetTime(1000);
+  FakeInput::level = 1;
+  Switch::Init();
+  Queue::Flush();
+  SetTime(1010);
+  EXPECT_EQ(1, Change(0));
+  Event event = Queue::PullEvent();
+  EXPECT_EQ(CONTROL_SWITCH, event.control_type);
+  EXPECT_EQ(3, event.control_id);
+  EXPECT_EQ(1, event.value);
+  // Bounces.
+  SetTime(1011);
+  EXPECT_EQ(0, Change(1));
+  EXPECT_EQ(0, Change(0));
+  // Released during the lockout: reported by Poll() once it is over.
+  SetTime(1012);
+  EXPECT_EQ(0, Change(1));
+  Switch::Poll<Queue>(3);
+  EXPECT_EQ(0, Queue::available());
+  SetTime(1015);
+  Switch::Poll<Queue>(3);
+  EXPECT_EQ(1, Queue::available());
+  EXPECT_EQ(0, Queue::PullEvent().value);
+}
+
+static void TestNoLockoutEvery256Ms() {
+  SetTime(2000);
+  FakeInput::level = 1;
+  Switch::Init();
+  Queue::Flush();
+  SetTime(2000 + 256);
+  EXPECT_EQ(1, Change(0));
+  SetTime(2000 + 256 + 256 + 2);
+  EXPECT_EQ(1, Change(1));
+}
+
+int main(void) {
+  TestLockout();
+  TestNoLockoutEvery256Ms();
+  return HostTestResult("pin_change_input_test");
+}
@@ -0,0 +1,129 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Benchmark of the PotScanner filters on synthetic ADC traces: noise floor
+// (peak to peak output at 7 bits on a noisy constant input), spike rejection,
+// latency (readings for a step to settle), and RAM for 16 pots.
+
+#include <stdlib.h>
+
+#include "avrlib/devices/pot_scanner.h"
+#include "host_test.h"
+
+using namespace avrlib;
+
+const uint8_t kNumPots = 16;
+const uint8_t kOversampling = 8;
+const uint8_t kShift = 4;  // From 8 + log2(8) bits to 7 bits.
+
+struct Stats {
+  uint16_t noise;
+  uint16_t spike_error;
+  uint16_t latency;
+  uint16_t ram;
+};
+
+// Triangular noise of +/- 3 LSB around level.
+static uint8_t Noisy(uint8_t level) {
+  return level + (rand() % 4) + (rand() % 4) - 3;
+}
+
+template<PotFilterType type>
+struct Benchmark {
+  typedef PotFilter<Benchmark<type>, type, kNumPots, kOversampling> Filter;
+
+  static uint16_t output() {
+    return Filter::value(0) >> kShift;
+  }
+
+  static void Feed(uint8_t sample) {
+    Filter::Process(0, sample);
+    Filter::EndOfScan();
+  }
+
+  static Stats Run() {
+    Stats stats;
+    stats.ram = Filter::state_size;
+    srand(42);
+    Filter::Init();
+
+    // Noise floor.
+    uint16_t low = 0xffff;
+    uint16_t high = 0;
+    for (uint16_t i = 0; i < 1000; ++i) {
+      Feed(Noisy(128));
+      if (i >= 100) {
+        low = output() < low ? output() : low;
+        high = output() > high ? output() : high;
+      }
+    }
+    stats.noise = high - low;
+
+    // Isolated spikes of +100 LSB, on a clean input.
+    for (uint16_t i = 0; i < 100; ++i) {
+      Feed(128);
+    }
+    stats.spike_error = 0;
+    for (uint16_t i = 0; i < 1000; ++i) {
+      Feed(i % 50 == 0 ? 228 : 128);
+      uint16_t error = output() > 64 ? output() - 64 : 64 - output();
+      if (error > stats.spike_error) {
+        stats.spike_error = error;
+      }
+    }
+
+    // Step from 50 to 200.
+    for (uint16_t i = 0; i < 100; ++i) {
+      Feed(50);
+    }
+    stats.latency = 0;
+    while (output() != 100 && stats.latency < 1000) {
+      Feed(200);
+      ++stats.latency;
+    }
+    return stats;
+  }
+};
+
+static void Print(const char* name, const Stats& stats) {
+  printf("%-10s %9d %12d %13d %10d\n", name, stats.noise, stats.spike_error,
+         stats.latency, stats.ram);
+}
+
+int main(void) {
+  printf("filter     noise p-p  spike error  step latency  RAM bytes\n");
+  Stats boxcar = Benchmark<POT_FILTER_BOXCAR>::Run();
+  Stats one_pole = Benchmark<POT_FILTER_ONE_POLE>::Run();
+  Stats cic = Benchmark<POT_FILTER_CIC>::Run();
+  Stats median = Benchmark<POT_FILTER_MEDIAN_3>::Run();
+  Print("boxcar", boxcar);
+  Print("one-pole", one_pole);
+  Print("cic", cic);
+  Print("median-3", median);
+
+  // The raw readings have a peak to peak noise of 3 steps at 7 bits.
+  EXPECT(boxcar.noise <= 1);
+  EXPECT(one_pole.noise <= 2);
+  EXPECT(cic.noise <= 1);
+  EXPECT(median.spike_error == 0);
+  EXPECT(boxcar.latency <= kOversampling);
+  EXPECT(cic.latency <= 2 * kOversampling);
+  EXPECT(median.latency <= 2);
+  EXPECT(one_pole.latency < 1000);
+  EXPECT(one_pole.ram < boxcar.ram);
+  return HostTestResult("pot_scanner_test");
+}
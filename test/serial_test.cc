@@ -0,0 +1,297 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Model of the UART transmitter of port 0, advanced one bit period at a time:
+// the data register (UDR0) is loaded into the shift register as soon as the
+// previous frame (10 bits) has been shifted out, and the data register empty
+// interrupt runs whenever it is enabled and UDR0 is empty. Checks that
+// interrupt-driven output keeps the line busy (back-to-back frames at full
+// baud rate) while the main loop only queues bytes, with and without
+// SendBuffer(), and that buffered output never enables the interrupt.
+// Reception: counting of the errors flagged by the UART and of the bytes
+// dropped when the input buffer is full, and binning of the gaps between the
+// received bytes, with a fake timer.
+
+#include <string.h>
+
+#include "avrlib/serial.h"
+#include "host_test.h"
+
+using namespace avrlib;
+
+const uint8_t kFrameSize = 10;
+const uint16_t kMaxBitPeriods = 20000;
+
+// Transmitter state.
+uint8_t udr_full;
+uint8_t shifting;
+uint8_t bits_left;
+uint8_t shift_register;
+
+// Bytes sent on the line, and bit periods elapsed between the start of the
+// first frame and the end of the last one.
+uint8_t wire[512];
+uint16_t wire_size;
+uint16_t line_busy_time;
+uint16_t now;
+uint16_t first_frame_start;
+
+// Data register empty interrupt: enabled, and its handler may fill UDR0.
+typedef void (*Handler)();
+Handler handler;
+
+static void ResetModel(Handler udre_handler) {
+  udr_full = shifting = 0;
+  wire_size = line_busy_time = now = 0;
+  handler = udre_handler;
+  UCSR0A = _BV(UDRE0);
+  UCSR0B = 0;
+}
+
+// Returns 0 once the line is idle and nothing is left to send.
+static uint8_t Step() {
+  ++now;
+  if (shifting && --bits_left == 0) {
+    wire[wire_size++] = shift_register;
+    line_busy_time = now - first_frame_start;
+    shifting = 0;
+  }
+  if (!shifting && udr_full) {
+    if (!wire_size) {
+      first_frame_start = now;
+    }
+    shift_register = UDR0;
+    shifting = 1;
+    bits_left = kFrameSize;
+    udr_full = 0;
+  }
+  UCSR0A = udr_full ? 0 : _BV(UDRE0);
+  if (!udr_full && (UCSR0B & _BV(UDRIE0))) {
+    handler();
+    // The handler either writes the next byte, or disables the interrupt.
+    if (UCSR0B & _BV(UDRIE0)) {
+      udr_full = 1;
+      UCSR0A = 0;
+    }
+  }
+  return shifting || udr_full || (UCSR0B & _BV(UDRIE0));
+}
+
+typedef Serial<SerialPort0, 31250, POLLED, INTERRUPT_DRIVEN> InterruptSerial;
+typedef Serial<SerialPort0, 31250, POLLED, BUFFERED> BufferedSerial;
+
+struct FakeTimer {
+  static uint8_t value() { return ticks; }
+  static uint8_t ticks;
+};
+
+uint8_t FakeTimer::ticks;
+
+typedef SerialRxGapHistogram<FakeTimer> GapHistogram;
+typedef Serial<SerialPort0, 31250, BUFFERED, POLLED, false,
+               GapHistogram> ReceivingSerial;
+
+static void InterruptHandler() {
+  InterruptSerial::Requested();
+}
+
+// The main loop queues the message as fast as the output buffer accepts it.
+static void TestBackToBack() {
+  uint8_t message[200];
+  for (uint8_t i = 0; i < sizeof(message); ++i) {
+    message[i] = i * 7;
+  }
+  InterruptSerial::Init();
+  ResetModel(&InterruptHandler);
+  uint16_t queued = 0;
+  uint16_t bit_periods = 0;
+  while ((queued < sizeof(message) || Step()) &&
+         bit_periods < kMaxBitPeriods) {
+    if (queued < sizeof(message) &&
+        InterruptSerial::NonBlockingWrite(message[queued])) {
+      ++queued;
+    }
+    if (queued < sizeof(message)) {
+      Step();
+    }
+    ++bit_periods;
+  }
+  EXPECT_EQ(sizeof(message), wire_size);
+  EXPECT(!memcmp(message, wire, sizeof(message)));
+  EXPECT_EQ(wire_size * kFrameSize, line_busy_time);
+  EXPECT(!(UCSR0B & _BV(UDRIE0)));
+  printf("Write():      %d bytes in %d bit periods (%d at full baud rate)\n",
+         wire_size, line_busy_time, wire_size * kFrameSize);
+}
+
+// A buffer sent with SendBuffer(), interleaved with bytes written during the
+// transfer.
+static void TestSendBuffer() {
+  uint8_t dump[300];
+  for (uint16_t i = 0; i < sizeof(dump); ++i) {
+    dump[i] = i & 0x7f;
+  }
+  InterruptSerial::Init();
+  ResetModel(&InterruptHandler);
+  InterruptSerial::SendBuffer(dump, sizeof(dump), false);
+  EXPECT(!InterruptSerial::buffer_sent());
+  uint16_t bit_periods = 0;
+  uint16_t clock_position = 0;
+  while (Step() && bit_periods < kMaxBitPeriods) {
+    if (bit_periods == 1000) {
+      InterruptSerial::Write(0xf8);
+      clock_position = wire_size;
+    }
+    ++bit_periods;
+  }
+  EXPECT(InterruptSerial::buffer_sent());
+  EXPECT_EQ(sizeof(dump) + 1, wire_size);
+  EXPECT_EQ(wire_size * kFrameSize, line_busy_time);
+  // The clock is sent right after the byte being shifted out, and the one
+  // already in the data register.
+  EXPECT_EQ(0xf8, wire[clock_position + 2]);
+  EXPECT(!memcmp(dump, wire, clock_position + 2));
+  EXPECT(!memcmp(dump + clock_position + 2, wire + clock_position + 3,
+                 sizeof(dump) - clock_position - 2));
+  printf("SendBuffer(): %d bytes in %d bit periods (%d at full baud rate)\n",
+         wire_size, line_busy_time, wire_size * kFrameSize);
+}
+
+// Buffered output must not enable the interrupt, which may have no handler.
+static void TestBufferedDoesNotEnableInterrupt() {
+  BufferedSerial::Init();
+  ResetModel(&InterruptHandler);
+  BufferedSerial::Write(0x90);
+  BufferedSerial::NonBlockingWrite(60);
+  BufferedSerial::Overwrite(100);
+  EXPECT(!(UCSR0B & _BV(UDRIE0)));
+  // Polling sends the bytes one at a time, as the data register empties.
+  EXPECT_EQ(3, BufferedSerial::Output::readable());
+  BufferedSerial::Requested();
+  EXPECT_EQ(2, BufferedSerial::Output::readable());
+  EXPECT_EQ(0x90, UDR0);
+  UCSR0A = 0;
+  BufferedSerial::Requested();
+  EXPECT_EQ(2, BufferedSerial::Output::readable());
+  UCSR0A = _BV(UDRE0);
+  BufferedSerial::Requested();
+  BufferedSerial::Requested();
+  EXPECT_EQ(0, BufferedSerial::Output::readable());
+  EXPECT_EQ(100, UDR0);
+}
+
+// The output of a serial port composed with another input.
+static void TestInputOutputRequested() {
+  typedef InputOutput<DisabledInput, SerialOutput<SerialPort0> > IO;
+  BufferedSerial::Init();
+  ResetModel(&InterruptHandler);
+  IO::Overwrite(0x42);
+  IO::Requested();
+  EXPECT_EQ(0x42, UDR0);
+}
+
+static void Receive(uint8_t byte, uint8_t status) {
+  UCSR0A = _BV(RXC0) | status;
+  UDR0 = byte;
+  ReceivingSerial::Received();
+}
+
+static void TestRxErrors() {
+  ReceivingSerial::Init();
+  ReceivingSerial::Input::Flush();
+  ReceivingSerial::ResetRxErrors();
+  Receive(0x90, 0);
+  Receive(0x3c, kSerialFramingErrorFlag);
+  Receive(0x64, kSerialDataOverrunFlag);
+  Receive(0x80, kSerialParityErrorFlag | kSerialFramingErrorFlag);
+  EXPECT_EQ(2, ReceivingSerial::rx_errors(SERIAL_RX_ERROR_FRAMING));
+  EXPECT_EQ(1, ReceivingSerial::rx_errors(SERIAL_RX_ERROR_OVERRUN));
+  EXPECT_EQ(1, ReceivingSerial::rx_errors(SERIAL_RX_ERROR_PARITY));
+  EXPECT_EQ(0, ReceivingSerial::rx_errors(SERIAL_RX_ERROR_BUFFER_FULL));
+  // The bytes received with an error are still queued.
+  EXPECT_EQ(4, ReceivingSerial::readable());
+  EXPECT_EQ(0x90, ReceivingSerial::Read());
+  EXPECT_EQ(0x3c, ReceivingSerial::Read());
+
+  // Nothing is received when the UART has no byte ready.
+  UCSR0A = kSerialFramingErrorFlag;
+  ReceivingSerial::Received();
+  EXPECT_EQ(2, ReceivingSerial::rx_errors(SERIAL_RX_ERROR_FRAMING));
+  EXPECT_EQ(2, ReceivingSerial::readable());
+
+  // The buffer keeps size - 1 bytes.
+  ReceivingSerial::Input::Flush();
+  for (uint8_t i = 0; i < kSerialInputBufferSize + 3; ++i) {
+    Receive(i, 0);
+  }
+  EXPECT_EQ(kSerialInputBufferSize - 1, ReceivingSerial::readable());
+  EXPECT_EQ(4, ReceivingSerial::rx_errors(SERIAL_RX_ERROR_BUFFER_FULL));
+  EXPECT_EQ(0, ReceivingSerial::Read());
+
+  ReceivingSerial::ResetRxErrors();
+  for (uint8_t i = 0; i < SERIAL_RX_ERROR_LAST; ++i) {
+    EXPECT_EQ(0, ReceivingSerial::rx_errors(static_cast<SerialRxError>(i)));
+  }
+  ReceivingSerial::Input::Flush();
+}
+
+static void ReceiveAt(uint32_t ms, uint8_t ticks) {
+  timer0_milliseconds.value = ms;
+  FakeTimer::ticks = ticks;
+  Receive(0xf8, 0);
+}
+
+static void TestGapHistogram() {
+  ReceivingSerial::Init();
+  ReceivingSerial::Input::Flush();
+  ReceiveAt(1000, 0);
+  GapHistogram::ResetStatistics();
+  ReceiveAt(1000, 0);  // Same tick: bin 0.
+  ReceiveAt(1000, 1);  // 1 tick: bin 1.
+  ReceiveAt(1000, 26);  // 25 ticks (one byte at 31250 bauds): bin 5.
+  ReceiveAt(1000, 57);  // 31 ticks: bin 5.
+  ReceiveAt(1000, 89);  // 32 ticks: bin 6.
+  ReceiveAt(1001, 239);  // 150 ticks, across a millisecond: bin 8.
+  ReceiveAt(1001, 10);  // 27 ticks, across the overflow of the timer: bin 5.
+  ReceiveAt(1003, 20);  // 2 ms: the last bin, whatever the timer says.
+  ReceiveAt(1500, 20);
+  EXPECT_EQ(1, GapHistogram::histogram(0));
+  EXPECT_EQ(1, GapHistogram::histogram(1));
+  EXPECT_EQ(0, GapHistogram::histogram(2));
+  EXPECT_EQ(3, GapHistogram::histogram(5));
+  EXPECT_EQ(1, GapHistogram::histogram(6));
+  EXPECT_EQ(1, GapHistogram::histogram(8));
+  EXPECT_EQ(2, GapHistogram::histogram(GapHistogram::num_bins - 1));
+  // The bytes are passed to the input buffer.
+  EXPECT_EQ(10, ReceivingSerial::readable());
+
+  GapHistogram::ResetStatistics();
+  for (uint8_t i = 0; i < GapHistogram::num_bins; ++i) {
+    EXPECT_EQ(0, GapHistogram::histogram(i));
+  }
+  ReceivingSerial::Input::Flush();
+}
+
+int main(void) {
+  TestBufferedDoesNotEnableInterrupt();
+  TestInputOutputRequested();
+  TestBackToBack();
+  TestSendBuffer();
+  TestRxErrors();
+  TestGapHistogram();
+  return HostTestResult("serial_test");
+}
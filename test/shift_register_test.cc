@@ -0,0 +1,131 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// The SHIFT_REGISTER_SPI backend must put the same bits on the wire, in the
+// same order, as the SHIFT_REGISTER_GPIO backend - and read back the same
+// words - for MSB_FIRST and LSB_FIRST, with 8 and 16 bits registers. The GPIO
+// backend drives fake pins, the SPI backend the model of SPDR in
+// host/registers.cc. Both are connected to a model of a chain of 74HC165
+// (parallel in, serial out) whose first bit out is the last parallel input.
+
+#include <string.h>
+
+#include "avrlib/devices/shift_register.h"
+#include "host_test.h"
+
+using namespace avrlib;
+
+// Bits clocked out on the data line.
+uint8_t trace[16];
+uint8_t trace_size;
+
+// Model of the input shift registers.
+uint16_t parallel_inputs;
+uint16_t chain;
+uint8_t chain_size;
+
+uint8_t data_level;
+
+static uint8_t SerialOut() {
+  return (chain >> (chain_size - 1)) & 1;
+}
+
+static uint8_t Shift(uint8_t bit) {
+  uint8_t out = SerialOut();
+  chain <<= 1;
+  if (trace_size < sizeof(trace)) {
+    trace[trace_size++] = bit;
+  }
+  return out;
+}
+
+// Latch/load: the inputs are loaded while low.
+struct FakeLatch {
+  static void set_mode(uint8_t mode) { }
+  static void Low() { chain = parallel_inputs; }
+  static void High() { }
+};
+
+struct FakeClock {
+  static void set_mode(uint8_t mode) { }
+  static void Low() { }
+  static void High() { Shift(data_level); }
+};
+
+struct FakeData {
+  static void set_mode(uint8_t mode) { }
+  static void Low() { data_level = 0; }
+  static void High() { data_level = 1; }
+  static void set_value(uint8_t value) { data_level = value; }
+  static uint8_t value() { return SerialOut(); }
+};
+
+template<uint8_t size, DataOrder order>
+struct Equivalence {
+  typedef typename DataTypeForSize<size>::Type T;
+  typedef ShiftRegisterOutput<
+      FakeLatch, FakeClock, FakeData, size, order,
+      SHIFT_REGISTER_GPIO> GpioOutput;
+  typedef ShiftRegisterOutput<
+      FakeLatch, FakeClock, FakeData, size, order,
+      SHIFT_REGISTER_SPI> SpiOutput;
+  typedef ShiftRegisterInput<
+      FakeLatch, FakeClock, FakeData, size, order,
+      SHIFT_REGISTER_GPIO> GpioInput;
+  typedef ShiftRegisterInput<
+      FakeLatch, FakeClock, FakeData, size, order,
+      SHIFT_REGISTER_SPI> SpiInput;
+
+  static void Run() {
+    chain_size = size;
+    SpiOutput::Init();
+    SpiInput::Init();
+    const T words[] = { 0x01, 0x80, T(0x1234), T(0xa5c3), T(~T(0)) };
+    for (uint8_t i = 0; i < sizeof(words) / sizeof(T); ++i) {
+      uint8_t expected[sizeof(trace)];
+      trace_size = 0;
+      GpioOutput::Write(words[i]);
+      EXPECT_EQ(size, trace_size);
+      memcpy(expected, trace, size);
+      trace_size = 0;
+      SpiOutput::Write(words[i]);
+      EXPECT_EQ(size, trace_size);
+      EXPECT(!memcmp(expected, trace, size));
+
+      parallel_inputs = words[i];
+      T gpio_word = GpioInput::Read();
+      T spi_word = SpiInput::Read();
+      EXPECT_EQ(gpio_word, spi_word);
+    }
+    // The order of the bits on the wire.
+    trace_size = 0;
+    GpioOutput::Write(1);
+    EXPECT_EQ(1, trace[order == LSB_FIRST ? 0 : size - 1]);
+  }
+};
+
+int main(void) {
+  host_spi_shift = &Shift;
+  SPSR = 0;
+  Equivalence<8, MSB_FIRST>::Run();
+  Equivalence<8, LSB_FIRST>::Run();
+  Equivalence<16, MSB_FIRST>::Run();
+  Equivalence<16, LSB_FIRST>::Run();
+  // Each transfer restores the settings of the SPI peripheral.
+  EXPECT_EQ(0, SPCR);
+  return HostTestResult("shift_register_test");
+}
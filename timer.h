@@ -226,11 +226,73 @@ typedef PwmChannel<Timer<1>, COM1B1, OCR1BRegister> PwmChannel1B;
 typedef PwmChannel<Timer<2>, COM2A1, OCR2ARegister> PwmChannel2A;
 typedef PwmChannel<Timer<2>, COM2B1, OCR2BRegister> PwmChannel2B;
 
+// Configuration of a timer in CTC mode, with the smallest prescaler allowing
+// the requested period (in CPU cycles) to be reached.
+template<int n>
+struct CtcTimerSetup { };
+
+template<> struct CtcTimerSetup<0> {
+  static inline void Setup(uint32_t period) {
+    uint8_t prescaler = 1;
+    if (period > 256) { period >>= 3; prescaler = 2; }  // 8
+    if (period > 256) { period >>= 3; prescaler = 3; }  // 64
+    if (period > 256) { period >>= 2; prescaler = 4; }  // 256
+    if (period > 256) { period >>= 2; prescaler = 5; }  // 1024
+    TCCR0A = _BV(WGM01);
+    TCCR0B = prescaler;
+    OCR0A = period - 1;
+  }
+};
+
+template<> struct CtcTimerSetup<1> {
+  static inline void Setup(uint32_t period) {
+    uint8_t prescaler = 1;
+    if (period > 65536) { period >>= 3; prescaler = 2; }  // 8
+    if (period > 65536) { period >>= 3; prescaler = 3; }  // 64
+    if (period > 65536) { period >>= 2; prescaler = 4; }  // 256
+    if (period > 65536) { period >>= 2; prescaler = 5; }  // 1024
+    TCCR1A = 0;
+    TCCR1B = _BV(WGM12) | prescaler;
+    OCR1A = period - 1;
+  }
+};
+
+template<> struct CtcTimerSetup<2> {
+  static inline void Setup(uint32_t period) {
+    uint8_t prescaler = 1;
+    if (period > 256) { period >>= 3; prescaler = 2; }  // 8
+    if (period > 256) { period >>= 2; prescaler = 3; }  // 32
+    if (period > 256) { period >>= 1; prescaler = 4; }  // 64
+    if (period > 256) { period >>= 1; prescaler = 5; }  // 128
+    if (period > 256) { period >>= 1; prescaler = 6; }  // 256
+    if (period > 256) { period >>= 2; prescaler = 7; }  // 1024
+    TCCR2A = _BV(WGM21);
+    TCCR2B = prescaler;
+    OCR2A = period - 1;
+  }
+};
+
+// A timer generating a compare match interrupt at a fixed frequency. The
+// interrupt is handled with TIMER_n_COMPARE. Note that timer 0 is used by the
+// system clock (InitClock).
+template<int n, uint32_t frequency>
+struct PeriodicTimer {
+  static inline void Init() {
+    CtcTimerSetup<n>::Setup(F_CPU / frequency);
+  }
+  static inline void Start() { Timer<n>::StartCompare(); }
+  static inline void Stop() { Timer<n>::StopCompare(); }
+};
+
 // Readable aliases for timer interrupts.
 #define TIMER_0_TICK ISR(TIMER0_OVF_vect)
 #define TIMER_1_TICK ISR(TIMER1_OVF_vect)
 #define TIMER_2_TICK ISR(TIMER2_OVF_vect)
 
+#define TIMER_0_COMPARE ISR(TIMER0_COMPA_vect)
+#define TIMER_1_COMPARE ISR(TIMER1_COMPA_vect)
+#define TIMER_2_COMPARE ISR(TIMER2_COMPA_vect)
+
 #ifdef HAS_TIMER3
 #define TIMER_3_TICK ISR(TIMER3_OVF_vect)
 #endif  // HAS_TIMER3
@@ -16,10 +16,34 @@
 // -----------------------------------------------------------------------------
 //
 // Event queue.
+//
+// Two event formats are available:
+// - EVENT_FORMAT_COMPACT: 16 bits per event, with 2 bits for the control type,
+// 6 bits for the control id, and 8 bits for the value.
+// - EVENT_FORMAT_WIDE: 32 bits per event, with 8 bits for the control type,
+// 8 bits for the control id, and 16 bits for the value.
+//
+// When num_coalesced_ids is not null, the pot and encoder events with an id
+// lower than num_coalesced_ids are coalesced: if an event for the same control
+// is still waiting in the queue, it is updated in place (pots) or its value
+// is incremented (encoders), instead of adding a new event. The queue length is
+// thus bounded by the number of controls, even when they are moved quickly.
+// The position in the queue of the last event of each id is stored in a
+// num_coalesced_ids bytes index.
+//
+// When timestamped is set, the time (in ms) at which each event has been added
+// is stored along with it, and the time elapsed between the addition and the
+// consumption of each event is recorded by PullEvent() in a latency histogram.
+// Bin i counts the events pulled after i ms, the last bin counts the events
+// pulled after num_latency_bins - 1 ms or more. A coalesced event keeps the
+// timestamp of the oldest change it holds.
 
 #ifndef AVRLIB_UI_EVENT_QUEUE_H_
 #define AVRLIB_UI_EVENT_QUEUE_H_
 
+#include <avr/interrupt.h>
+#include <string.h>
+
 #include "avrlib/base.h"
 #include "avrlib/op.h"
 #include "avrlib/ring_buffer.h"
@@ -34,21 +58,132 @@ enum ControlType {
   CONTROL_SWITCH = 3
 };
 
+enum EventFormat {
+  EVENT_FORMAT_COMPACT,
+  EVENT_FORMAT_WIDE
+};
+
 struct Event {
   uint8_t control_type;
   uint8_t control_id;
   uint8_t value;
 };
 
-template<uint8_t size = 32>
+struct WideEvent {
+  uint8_t control_type;
+  uint8_t control_id;
+  uint16_t value;
+};
+
+template<EventFormat format>
+struct EventCodec { };
+
+template<>
+struct EventCodec<EVENT_FORMAT_COMPACT> {
+  enum {
+    data_size = 16,
+    num_control_ids = 64
+  };
+  typedef uint16_t Value;
+  typedef Event EventType;
+  
+  static inline Value Pack(uint8_t control_type, uint8_t id, uint16_t data) {
+    Word v;
+    v.bytes[0] = (U8ShiftLeft4(control_type) << 2) | (id & 0x3f);
+    v.bytes[1] = data;
+    return v.value;
+  }
+  
+  static inline Event Unpack(Value value) {
+    Event e;
+    Word v;
+    v.value = value;
+    e.control_type = U8ShiftRight4(v.bytes[0]) >> 2;
+    e.control_id = v.bytes[0] & 0x3f;
+    e.value = v.bytes[1];
+    return e;
+  }
+  
+  static inline uint8_t same_control(Value a, Value b) {
+    Word v_a, v_b;
+    v_a.value = a;
+    v_b.value = b;
+    return v_a.bytes[0] == v_b.bytes[0];
+  }
+  
+  static inline Value Accumulate(Value a, Value b) {
+    Word v_a, v_b;
+    v_a.value = a;
+    v_b.value = b;
+    int16_t sum = static_cast<int8_t>(v_a.bytes[1]) +
+        static_cast<int8_t>(v_b.bytes[1]);
+    v_a.bytes[1] = sum > 127 ? 127 : (sum < -128 ? -128 : sum);
+    return v_a.value;
+  }
+};
+
+template<>
+struct EventCodec<EVENT_FORMAT_WIDE> {
+  enum {
+    data_size = 32,
+    num_control_ids = 256
+  };
+  typedef uint32_t Value;
+  typedef WideEvent EventType;
+  
+  static inline Value Pack(uint8_t control_type, uint8_t id, uint16_t data) {
+    LongWord v;
+    v.bytes[0] = control_type;
+    v.bytes[1] = id;
+    v.words[1] = data;
+    return v.value;
+  }
+  
+  static inline WideEvent Unpack(Value value) {
+    WideEvent e;
+    LongWord v;
+    v.value = value;
+    e.control_type = v.bytes[0];
+    e.control_id = v.bytes[1];
+    e.value = v.words[1];
+    return e;
+  }
+  
+  static inline uint8_t same_control(Value a, Value b) {
+    LongWord v_a, v_b;
+    v_a.value = a;
+    v_b.value = b;
+    return v_a.words[0] == v_b.words[0];
+  }
+  
+  static inline Value Accumulate(Value a, Value b) {
+    LongWord v_a, v_b;
+    v_a.value = a;
+    v_b.value = b;
+    int32_t sum = static_cast<int32_t>(static_cast<int16_t>(v_a.words[1])) +
+        static_cast<int16_t>(v_b.words[1]);
+    v_a.words[1] = sum > 32767 ? 32767 : (sum < -32768 ? -32768 : sum);
+    return v_a.value;
+  }
+};
+
+template<
+    uint8_t size = 32,
+    EventFormat format = EVENT_FORMAT_COMPACT,
+    uint8_t num_coalesced_ids = 0,
+    bool timestamped = false>
 class EventQueue {
  public:
+  typedef EventCodec<format> Codec;
   enum {
     buffer_size = size,
-    data_size = 16,
+    data_size = Codec::data_size,
+    num_control_ids = Codec::num_control_ids,
+    num_latency_bins = 8
   };
-  typedef uint16_t Value;
-  typedef EventQueue<size> Me;
+  typedef typename Codec::Value Value;
+  typedef typename Codec::EventType EventType;
+  typedef EventQueue<size, format, num_coalesced_ids, timestamped> Me;
    
   EventQueue() { }
   
@@ -56,11 +191,32 @@ class EventQueue {
     events_.Flush();
   };
   
-  static void AddEvent(uint8_t control_type, uint8_t id, uint8_t data) {
-    Word v;
-    v.bytes[0] = (U8ShiftLeft4(control_type) << 2) | (id & 0x3f);
-    v.bytes[1] = data;
-    events_.Overwrite(v.value);
+  static void AddEvent(uint8_t control_type, uint8_t id, uint16_t data) {
+    Value v = Codec::Pack(control_type, id, data);
+    if (num_coalesced_ids && id < num_coalesced_ids &&
+        (control_type == CONTROL_POT || control_type == CONTROL_ENCODER)) {
+      // The consumer must not read the event while it is modified.
+      uint8_t old_sreg = SREG;
+      cli();
+      uint8_t slot = slot_[id];
+      Value* pending = events_.data() + slot;
+      if (((slot - events_.read_ptr()) & (size - 1)) < events_.readable() &&
+          Codec::same_control(*pending, v)) {
+        *pending = control_type == CONTROL_ENCODER
+            ? Codec::Accumulate(*pending, v)
+            : v;
+      } else {
+        slot_[id] = events_.write_ptr();
+        Append(v);
+      }
+      SREG = old_sreg;
+    } else {
+      // Events can be added both from ISRs and from the main loop.
+      uint8_t old_sreg = SREG;
+      cli();
+      Append(v);
+      SREG = old_sreg;
+    }
   }
   
   static uint8_t available() {
@@ -81,28 +237,100 @@ class EventQueue {
     last_event_time_ = milliseconds();
   }
   
-  static Event PullEvent() {
-    Event e;
-    Word v;
-    v.value = events_.ImmediateRead();
-    e.control_type = U8ShiftRight4(v.bytes[0]) >> 2;
-    e.control_id = v.bytes[0] & 0x3f;
-    e.value = v.bytes[1];
-    return e;
+  static EventType PullEvent() {
+    Value v;
+    uint16_t timestamp = 0;
+    if (num_coalesced_ids) {
+      uint8_t old_sreg = SREG;
+      cli();
+      if (timestamped) {
+        timestamp = timestamp_[events_.read_ptr()];
+      }
+      v = events_.ImmediateRead();
+      SREG = old_sreg;
+    } else {
+      if (timestamped) {
+        timestamp = timestamp_[events_.read_ptr()];
+      }
+      v = events_.ImmediateRead();
+    }
+    if (timestamped) {
+      RecordLatency(static_cast<uint16_t>(milliseconds()) - timestamp);
+    }
+    return Codec::Unpack(v);
+  }
+  
+  // Latency, in ms, of the last event pulled.
+  static uint16_t last_latency() { return last_latency_; }
+  static uint16_t max_latency() { return max_latency_; }
+  static uint16_t latency_histogram(uint8_t bin) {
+    return latency_histogram_[bin];
+  }
+  
+  static void ResetLatencyStatistics() {
+    memset(latency_histogram_, 0, sizeof(latency_histogram_));
+    max_latency_ = 0;
   }
   
  private:
+  static inline void Append(Value v) {
+    if (timestamped) {
+      timestamp_[events_.write_ptr()] = milliseconds();
+    }
+    events_.Overwrite(v);
+  }
+  
+  static inline void RecordLatency(uint16_t latency) {
+    last_latency_ = latency;
+    if (latency > max_latency_) {
+      max_latency_ = latency;
+    }
+    uint8_t bin = latency >= num_latency_bins - 1
+        ? num_latency_bins - 1
+        : latency;
+    // Saturate instead of wrapping around.
+    if (latency_histogram_[bin] != 0xffff) {
+      ++latency_histogram_[bin];
+    }
+  }
+  
   static uint32_t last_event_time_;
   static RingBuffer<Me> events_;
+  static uint8_t slot_[num_coalesced_ids ? num_coalesced_ids : 1];
+  static uint16_t timestamp_[timestamped ? size : 1];
+  static uint16_t last_latency_;
+  static uint16_t max_latency_;
+  static uint16_t latency_histogram_[num_latency_bins];
 };
 
 /* static */
-template<uint8_t size>
-RingBuffer<EventQueue<size> > EventQueue<size>::events_;
+template<uint8_t s, EventFormat f, uint8_t n, bool t>
+RingBuffer<EventQueue<s, f, n, t> > EventQueue<s, f, n, t>::events_;
+
+/* static */
+template<uint8_t s, EventFormat f, uint8_t n, bool t>
+uint32_t EventQueue<s, f, n, t>::last_event_time_;
+
+/* static */
+template<uint8_t s, EventFormat f, uint8_t n, bool t>
+uint8_t EventQueue<s, f, n, t>::slot_[n ? n : 1];
+
+/* static */
+template<uint8_t s, EventFormat f, uint8_t n, bool t>
+uint16_t EventQueue<s, f, n, t>::timestamp_[t ? s : 1];
+
+/* static */
+template<uint8_t s, EventFormat f, uint8_t n, bool t>
+uint16_t EventQueue<s, f, n, t>::last_latency_;
+
+/* static */
+template<uint8_t s, EventFormat f, uint8_t n, bool t>
+uint16_t EventQueue<s, f, n, t>::max_latency_;
 
 /* static */
-template<uint8_t size>
-uint32_t EventQueue<size>::last_event_time_;
+template<uint8_t s, EventFormat f, uint8_t n, bool t>
+uint16_t EventQueue<s, f, n, t>::latency_histogram_[
+    EventQueue<s, f, n, t>::num_latency_bins];
 
 }  // namespace avrlib
 